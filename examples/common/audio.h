@@ -0,0 +1,178 @@
+#pragma once
+/*
+    Audio streaming between the emulator and the sokol-audio callback.
+
+    Samples pushed by the emulator go into a lock-free single-producer /
+    single-consumer ring buffer which is drained by the sokol-audio stream
+    callback, so the emulator never takes a lock in its sample push path.
+
+    In pull mode the audio callback's demand drives the emulation: call
+    audio_pull_time() once per frame to get the time to emulate so that the
+    ring buffer is topped up to its target fill level.
+*/
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef struct {
+    int ring_samples;       // ring buffer capacity in samples, rounded up to a power of 2 (default: 8192)
+    bool pull_mode;         // emulation is clocked by the audio callback's demand
+} audio_desc_t;
+
+typedef struct {
+    int capacity;           // ring buffer capacity in samples
+    int fill;               // number of samples currently in the ring buffer
+    int target_fill;        // fill level the pull mode (and rate control) aims for
+    uint32_t underruns;     // number of samples the audio callback had to fill with silence
+    uint32_t overruns;      // number of pushed samples dropped because the ring buffer was full
+} audio_stats_t;
+
+/* setup sokol-audio with a stream callback reading from the ring buffer */
+void audio_init(const audio_desc_t* desc);
+/* shutdown sokol-audio */
+void audio_shutdown(void);
+/* the audio device's sample rate */
+int audio_sample_rate(void);
+/* push emulator samples into the ring buffer (call from a single producer thread) */
+void audio_push(const float* samples, int num_samples);
+/* true if pull mode is active */
+bool audio_pull_mode(void);
+/* pull mode: time in microseconds to emulate this frame, fallback_us is returned while the audio device isn't running */
+uint32_t audio_pull_time(uint32_t fallback_us);
+/* get fill-level telemetry */
+audio_stats_t audio_stats(void);
+
+/*== IMPLEMENTATION ==========================================================*/
+#ifdef COMMON_IMPL
+#include "sokol_audio.h"
+#include "thread.h"
+#include <stdlib.h> // calloc/free
+#include <string.h>
+#include <assert.h>
+
+#define _AUDIO_DEFAULT_RING_SAMPLES (8192)
+#define _AUDIO_PULL_BUFFER_FRAMES (1024)
+
+typedef struct {
+    bool valid;
+    bool pull_mode;
+    int capacity;
+    int mask;
+    int target_fill;
+    volatile int head;          // total number of samples written, only modified by producer
+    volatile int tail;          // total number of samples read, only modified by consumer
+    volatile int underruns;
+    volatile int overruns;
+    float* buf;
+} audio_state_t;
+static audio_state_t audio;
+
+// number of samples in the ring, head and tail are free-running counters
+static int _audio_fill(void) {
+    const uint32_t head = (uint32_t) thread_atomic_load(&audio.head);
+    const uint32_t tail = (uint32_t) thread_atomic_load(&audio.tail);
+    return (int)(head - tail);
+}
+
+static void _audio_stream_cb(float* buffer, int num_frames, int num_channels) {
+    const uint32_t tail = (uint32_t) audio.tail;
+    const uint32_t head = (uint32_t) thread_atomic_load(&audio.head);
+    const int avail = (int)(head - tail);
+    const int num_read = (num_frames < avail) ? num_frames : avail;
+    for (int i = 0; i < num_read; i++) {
+        const float s = audio.buf[(tail + (uint32_t)i) & (uint32_t)audio.mask];
+        for (int c = 0; c < num_channels; c++) {
+            *buffer++ = s;
+        }
+    }
+    if (num_read < num_frames) {
+        memset(buffer, 0, (size_t)((num_frames - num_read) * num_channels) * sizeof(float));
+        thread_atomic_add(&audio.underruns, num_frames - num_read);
+    }
+    thread_atomic_store(&audio.tail, (int)(tail + (uint32_t)num_read));
+}
+
+void audio_init(const audio_desc_t* desc) {
+    assert(desc);
+    memset(&audio, 0, sizeof(audio));
+    const int min_capacity = desc->ring_samples > 0 ? desc->ring_samples : _AUDIO_DEFAULT_RING_SAMPLES;
+    audio.capacity = 1;
+    while (audio.capacity < min_capacity) {
+        audio.capacity <<= 1;
+    }
+    audio.mask = audio.capacity - 1;
+    audio.buf = (float*) calloc((size_t)audio.capacity, sizeof(float));
+    assert(audio.buf);
+    audio.pull_mode = desc->pull_mode;
+    saudio_setup(&(saudio_desc){
+        .buffer_frames = audio.pull_mode ? _AUDIO_PULL_BUFFER_FRAMES : 0,
+        .stream_cb = _audio_stream_cb,
+    });
+    // keep enough samples buffered to survive one audio callback plus a long frame
+    audio.target_fill = 2 * (saudio_isvalid() ? saudio_buffer_frames() : _AUDIO_PULL_BUFFER_FRAMES);
+    if (audio.target_fill > audio.capacity / 2) {
+        audio.target_fill = audio.capacity / 2;
+    }
+    audio.valid = true;
+}
+
+void audio_shutdown(void) {
+    assert(audio.valid);
+    saudio_shutdown();
+    free(audio.buf);
+    audio.buf = 0;
+    audio.valid = false;
+}
+
+int audio_sample_rate(void) {
+    assert(audio.valid);
+    return saudio_sample_rate();
+}
+
+void audio_push(const float* samples, int num_samples) {
+    assert(audio.valid);
+    const uint32_t head = (uint32_t) audio.head;
+    const uint32_t tail = (uint32_t) thread_atomic_load(&audio.tail);
+    const int space = audio.capacity - (int)(head - tail);
+    const int num_write = (num_samples < space) ? num_samples : space;
+    for (int i = 0; i < num_write; i++) {
+        audio.buf[(head + (uint32_t)i) & (uint32_t)audio.mask] = samples[i];
+    }
+    if (num_write < num_samples) {
+        thread_atomic_add(&audio.overruns, num_samples - num_write);
+    }
+    thread_atomic_store(&audio.head, (int)(head + (uint32_t)num_write));
+}
+
+bool audio_pull_mode(void) {
+    assert(audio.valid);
+    return audio.pull_mode;
+}
+
+uint32_t audio_pull_time(uint32_t fallback_us) {
+    assert(audio.valid);
+    if (!saudio_isvalid() || saudio_suspended()) {
+        return fallback_us;
+    }
+    const int missing = audio.target_fill - _audio_fill();
+    if (missing <= 0) {
+        return 0;
+    }
+    uint32_t time_us = (uint32_t) (((uint64_t)missing * 1000000) / (uint64_t)saudio_sample_rate());
+    // same death-spiral protection as clock_frame_time()
+    if (time_us > 24000) {
+        time_us = 24000;
+    }
+    return time_us;
+}
+
+audio_stats_t audio_stats(void) {
+    assert(audio.valid);
+    return (audio_stats_t) {
+        .capacity = audio.capacity,
+        .fill = _audio_fill(),
+        .target_fill = audio.target_fill,
+        .underruns = (uint32_t) thread_atomic_load(&audio.underruns),
+        .overruns = (uint32_t) thread_atomic_load(&audio.overruns),
+    };
+}
+#endif /* COMMON_IMPL */
@@ -0,0 +1,497 @@
+#pragma once
+/*
+    Raw video and audio capture of the emulator output.
+
+    Every emulated frame is copied out of the emulator framebuffer into a
+    buffer from a small recycled pool and queued for a background writer
+    thread, which converts it to YUV (for Y4M streams) and writes it to a
+    file or pipe. A real-time emulator never waits for the writer: when all
+    buffers are in flight the frame is dropped, counted, and written later
+    as a repeat of the previous frame, so that the stream keeps its frame
+    rate and stays in sync with the audio. Producers which aren't bound to
+    real time (e.g. headless runners) set capture_desc_t.wait instead, then
+    capture_frame() and capture_audio() block until a buffer is free and
+    every emulated frame is written.
+
+    Audio samples are attached to the buffer of the frame they belong to
+    and written as a 16-bit mono WAV file. Since the frames are captured
+    on emulated time boundaries (not host time), video and audio stay
+    tick-aligned regardless of how fast the emulator runs.
+
+    Video formats:
+
+        CAPTURE_FORMAT_Y4M: YUV4MPEG2 stream, 4:4:4 BT.601 (ffmpeg, mpv, x264 ...)
+        CAPTURE_FORMAT_RAW: headerless RGBA8 frames (ffmpeg -f rawvideo -pix_fmt rgba)
+
+    A path of "-" writes the stream to stdout. The WAV header sizes are
+    patched when capture_shutdown() is called, this isn't possible for
+    pipes, there the sizes are left at their maximum.
+*/
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define CAPTURE_MAX_BUFFERS (32)
+// max number of audio samples attached to one frame buffer
+#define CAPTURE_MAX_AUDIO_SAMPLES (8192)
+
+typedef enum {
+    CAPTURE_FORMAT_Y4M,
+    CAPTURE_FORMAT_RAW,
+} capture_format_t;
+
+typedef struct {
+    const char* video_path;     // file to write the video stream to, "-" for stdout
+    const char* audio_path;     // optional WAV file to write the audio stream to
+    capture_format_t format;    // video format (default: CAPTURE_FORMAT_Y4M)
+    int width;                  // frame size in pixels
+    int height;
+    int fps;                    // frames per second (default: 50)
+    int fps_den;                // optional frame rate denominator, fps/fps_den frames per second (default: 1)
+    int sample_rate;            // audio sample rate (default: 44100)
+    int num_buffers;            // number of frame buffers in the pool (default: 8)
+    bool wait;                  // wait for a free buffer instead of dropping frames
+} capture_desc_t;
+
+typedef struct {
+    uint64_t frames;            // frames captured (including dropped frames)
+    uint64_t dropped_frames;    // frames which found no free buffer and are written as repeats
+    uint64_t samples;           // audio samples captured
+    int buffers_in_use;         // frame buffers queued or being written
+} capture_stats_t;
+
+/* open the output files and start the writer thread, returns false if a file can't be opened */
+bool capture_init(const capture_desc_t* desc);
+/* write all queued frames, close the files and stop the writer thread */
+void capture_shutdown(void);
+/* true if capture_init() has succeeded */
+bool capture_isvalid(void);
+/* queue one emulated frame of RGBA8 pixels (cropped or padded to the capture size) */
+void capture_frame(const uint32_t* pixels, int width, int height);
+/* queue audio samples, these are attached to the next queued frame */
+void capture_audio(const float* samples, int num_samples);
+/* get the number of captured and dropped frames */
+capture_stats_t capture_stats(void);
+
+/*== IMPLEMENTATION ==========================================================*/
+#ifdef COMMON_IMPL
+#include "thread.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#if defined(_WIN32)
+#include <io.h>
+#include <fcntl.h>
+#endif
+
+#define _CAPTURE_DEF(v,def) (v?v:def)
+#define _CAPTURE_WAV_HEADER_SIZE (44)
+// how long the writer thread sleeps when the queue is empty
+#define _CAPTURE_IDLE_SLEEP_US (1000)
+// how long the emulator side sleeps between checks for a free buffer in wait mode
+#define _CAPTURE_WAIT_SLEEP_US (100)
+
+typedef struct {
+    uint32_t* pixels;
+    bool has_frame;             // false for an audio-only buffer
+    int repeat_frames;          // frames dropped before this one, written as repeats of the previous frame
+    float samples[CAPTURE_MAX_AUDIO_SAMPLES];
+    int num_samples;
+    int silent_samples;         // audio samples dropped before this buffer, written as silence
+} _capture_item_t;
+
+typedef struct {
+    bool valid;
+    capture_format_t format;
+    int width;
+    int height;
+    int sample_rate;
+    int num_items;
+    bool wait;
+    FILE* video_fp;
+    FILE* audio_fp;
+    thread_t thread;
+    thread_mutex_t lock;
+    volatile int quit;
+    _capture_item_t* items;
+    // free list and FIFO queue of item indices, guarded by lock
+    int free_items[CAPTURE_MAX_BUFFERS];
+    int num_free;
+    int queue[CAPTURE_MAX_BUFFERS];
+    int queue_head;
+    int queue_count;
+    // emulator side
+    int cur;                    // item collecting audio for the next frame, -1 if none
+    int dropped_frames;         // frames dropped since the last queued item
+    int dropped_samples;        // audio samples dropped since the last queued item
+    // writer side
+    uint8_t* out;               // converted frame, kept around for repeats
+    size_t out_size;
+    bool out_valid;
+    int16_t pcm[CAPTURE_MAX_AUDIO_SAMPLES];
+    // statistics, guarded by lock
+    capture_stats_t stats;
+} _capture_state_t;
+static _capture_state_t capture;
+
+static FILE* _capture_open(const char* path) {
+    if (0 == strcmp(path, "-")) {
+        #if defined(_WIN32)
+        _setmode(_fileno(stdout), _O_BINARY);
+        #endif
+        return stdout;
+    }
+    return fopen(path, "wb");
+}
+
+static void _capture_close(FILE* fp) {
+    if (fp && (fp != stdout)) {
+        fclose(fp);
+    }
+    else if (fp) {
+        fflush(fp);
+    }
+}
+
+static void _capture_put_u32(uint8_t* dst, uint32_t val) {
+    dst[0] = (uint8_t) val;
+    dst[1] = (uint8_t) (val >> 8);
+    dst[2] = (uint8_t) (val >> 16);
+    dst[3] = (uint8_t) (val >> 24);
+}
+
+static void _capture_put_u16(uint8_t* dst, uint16_t val) {
+    dst[0] = (uint8_t) val;
+    dst[1] = (uint8_t) (val >> 8);
+}
+
+// 16-bit mono PCM header, data_size 0xFFFFFFFF means 'unknown' (streaming)
+static void _capture_write_wav_header(FILE* fp, int sample_rate, uint32_t data_size) {
+    uint8_t hdr[_CAPTURE_WAV_HEADER_SIZE];
+    memcpy(hdr, "RIFF", 4);
+    _capture_put_u32(hdr + 4, (data_size == 0xFFFFFFFF) ? data_size : (36 + data_size));
+    memcpy(hdr + 8, "WAVEfmt ", 8);
+    _capture_put_u32(hdr + 16, 16);
+    _capture_put_u16(hdr + 20, 1);                          // PCM
+    _capture_put_u16(hdr + 22, 1);                          // mono
+    _capture_put_u32(hdr + 24, (uint32_t)sample_rate);
+    _capture_put_u32(hdr + 28, (uint32_t)sample_rate * 2);  // bytes per second
+    _capture_put_u16(hdr + 32, 2);                          // bytes per sample frame
+    _capture_put_u16(hdr + 34, 16);                         // bits per sample
+    memcpy(hdr + 36, "data", 4);
+    _capture_put_u32(hdr + 40, data_size);
+    fwrite(hdr, 1, sizeof(hdr), fp);
+}
+
+/* convert an RGBA8 frame (R in the lowest byte) into the output format,
+   for Y4M into 3 full-resolution planes with BT.601 studio-range integer math
+*/
+static void _capture_convert(const uint32_t* pixels) {
+    const int num_pixels = capture.width * capture.height;
+    if (capture.format == CAPTURE_FORMAT_RAW) {
+        memcpy(capture.out, pixels, (size_t)num_pixels * sizeof(uint32_t));
+        return;
+    }
+    uint8_t* y_plane = capture.out + 6;     // after "FRAME\n"
+    uint8_t* u_plane = y_plane + num_pixels;
+    uint8_t* v_plane = u_plane + num_pixels;
+    for (int i = 0; i < num_pixels; i++) {
+        const uint32_t c = pixels[i];
+        const int r = (int)(c & 0xFF);
+        const int g = (int)((c >> 8) & 0xFF);
+        const int b = (int)((c >> 16) & 0xFF);
+        y_plane[i] = (uint8_t) (((66 * r + 129 * g + 25 * b + 128) >> 8) + 16);
+        u_plane[i] = (uint8_t) (((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128);
+        v_plane[i] = (uint8_t) (((112 * r - 94 * g - 18 * b + 128) >> 8) + 128);
+    }
+}
+
+static void _capture_write_frame(void) {
+    if (capture.out_valid) {
+        fwrite(capture.out, 1, capture.out_size, capture.video_fp);
+    }
+}
+
+static void _capture_write_audio(const float* samples, int num_samples, int silent_samples) {
+    if (!capture.audio_fp) {
+        return;
+    }
+    memset(capture.pcm, 0, sizeof(capture.pcm));
+    while (silent_samples > 0) {
+        const int n = (silent_samples < CAPTURE_MAX_AUDIO_SAMPLES) ? silent_samples : CAPTURE_MAX_AUDIO_SAMPLES;
+        fwrite(capture.pcm, sizeof(int16_t), (size_t)n, capture.audio_fp);
+        silent_samples -= n;
+    }
+    for (int i = 0; i < num_samples; i++) {
+        float s = samples[i];
+        s = (s > 1.0f) ? 1.0f : ((s < -1.0f) ? -1.0f : s);
+        capture.pcm[i] = (int16_t) (s * 32767.0f);
+    }
+    fwrite(capture.pcm, sizeof(int16_t), (size_t)num_samples, capture.audio_fp);
+}
+
+// write one dequeued item, called on the writer thread without holding the lock
+static void _capture_write_item(_capture_item_t* item) {
+    for (int i = 0; i < item->repeat_frames; i++) {
+        _capture_write_frame();
+    }
+    if (item->has_frame) {
+        _capture_convert(item->pixels);
+        capture.out_valid = true;
+        _capture_write_frame();
+    }
+    _capture_write_audio(item->samples, item->num_samples, item->silent_samples);
+}
+
+// dequeue and write items until the queue is empty, returns false if nothing was written
+static bool _capture_drain(void) {
+    bool any = false;
+    for (;;) {
+        thread_mutex_lock(capture.lock);
+        if (capture.queue_count == 0) {
+            thread_mutex_unlock(capture.lock);
+            return any;
+        }
+        const int index = capture.queue[capture.queue_head];
+        capture.queue_head = (capture.queue_head + 1) % capture.num_items;
+        capture.queue_count--;
+        thread_mutex_unlock(capture.lock);
+
+        _capture_item_t* item = &capture.items[index];
+        _capture_write_item(item);
+        any = true;
+
+        thread_mutex_lock(capture.lock);
+        capture.free_items[capture.num_free++] = index;
+        thread_mutex_unlock(capture.lock);
+    }
+}
+
+static void _capture_thread_func(void* arg) {
+    (void)arg;
+    while (0 == thread_atomic_load(&capture.quit)) {
+        if (!_capture_drain()) {
+            thread_sleep_us(_CAPTURE_IDLE_SLEEP_US);
+        }
+    }
+    // write the remaining queue before capture_shutdown() closes the files
+    _capture_drain();
+}
+
+bool capture_init(const capture_desc_t* desc) {
+    assert(desc && desc->video_path);
+    assert((desc->width > 0) && (desc->height > 0));
+    assert(desc->num_buffers <= CAPTURE_MAX_BUFFERS);
+    memset(&capture, 0, sizeof(capture));
+    capture.format = desc->format;
+    capture.width = desc->width;
+    capture.height = desc->height;
+    capture.num_items = _CAPTURE_DEF(desc->num_buffers, 8);
+    capture.wait = desc->wait;
+    const int fps = _CAPTURE_DEF(desc->fps, 50);
+    const int fps_den = _CAPTURE_DEF(desc->fps_den, 1);
+    capture.sample_rate = _CAPTURE_DEF(desc->sample_rate, 44100);
+    capture.video_fp = _capture_open(desc->video_path);
+    if (!capture.video_fp) {
+        fprintf(stderr, "failed to open capture file '%s'\n", desc->video_path);
+        return false;
+    }
+    if (desc->audio_path) {
+        capture.audio_fp = _capture_open(desc->audio_path);
+        if (!capture.audio_fp) {
+            fprintf(stderr, "failed to open audio capture file '%s'\n", desc->audio_path);
+            _capture_close(capture.video_fp);
+            return false;
+        }
+        _capture_write_wav_header(capture.audio_fp, capture.sample_rate, 0xFFFFFFFF);
+    }
+    const size_t num_pixels = (size_t)(capture.width * capture.height);
+    if (capture.format == CAPTURE_FORMAT_Y4M) {
+        fprintf(capture.video_fp, "YUV4MPEG2 W%d H%d F%d:%d Ip A1:1 C444\n", capture.width, capture.height, fps, fps_den);
+        capture.out_size = 6 + 3 * num_pixels;
+    }
+    else {
+        capture.out_size = num_pixels * sizeof(uint32_t);
+    }
+    capture.out = (uint8_t*) malloc(capture.out_size);
+    assert(capture.out);
+    if (capture.format == CAPTURE_FORMAT_Y4M) {
+        memcpy(capture.out, "FRAME\n", 6);
+    }
+    capture.items = (_capture_item_t*) calloc((size_t)capture.num_items, sizeof(_capture_item_t));
+    assert(capture.items);
+    for (int i = 0; i < capture.num_items; i++) {
+        capture.items[i].pixels = (uint32_t*) malloc(num_pixels * sizeof(uint32_t));
+        assert(capture.items[i].pixels);
+        capture.free_items[i] = i;
+    }
+    capture.num_free = capture.num_items;
+    capture.cur = -1;
+    capture.lock = thread_mutex_create();
+    capture.thread = thread_start(_capture_thread_func, 0);
+    if (!capture.thread.handle) {
+        fprintf(stderr, "failed to start capture writer thread\n");
+        thread_mutex_destroy(capture.lock);
+        _capture_close(capture.video_fp);
+        _capture_close(capture.audio_fp);
+        return false;
+    }
+    capture.valid = true;
+    return true;
+}
+
+bool capture_isvalid(void) {
+    return capture.valid;
+}
+
+// get a free item, called on the emulator side with the lock held
+static int _capture_alloc_item(void) {
+    if (capture.num_free == 0) {
+        return -1;
+    }
+    const int index = capture.free_items[--capture.num_free];
+    _capture_item_t* item = &capture.items[index];
+    item->has_frame = false;
+    item->repeat_frames = 0;
+    item->num_samples = 0;
+    item->silent_samples = 0;
+    return index;
+}
+
+// make sure there's a current item, called on the emulator side with the lock
+// held, in wait mode the lock is released while waiting for the writer
+static void _capture_acquire_cur(void) {
+    if (capture.cur < 0) {
+        capture.cur = _capture_alloc_item();
+    }
+    while ((capture.cur < 0) && capture.wait) {
+        thread_mutex_unlock(capture.lock);
+        thread_sleep_us(_CAPTURE_WAIT_SLEEP_US);
+        thread_mutex_lock(capture.lock);
+        capture.cur = _capture_alloc_item();
+    }
+}
+
+// queue the current item, called on the emulator side with the lock held
+static void _capture_queue_cur(void) {
+    assert(capture.cur >= 0);
+    _capture_item_t* item = &capture.items[capture.cur];
+    item->repeat_frames = capture.dropped_frames;
+    item->silent_samples = capture.dropped_samples;
+    capture.dropped_frames = 0;
+    capture.dropped_samples = 0;
+    capture.queue[(capture.queue_head + capture.queue_count) % capture.num_items] = capture.cur;
+    capture.queue_count++;
+    capture.cur = -1;
+}
+
+void capture_frame(const uint32_t* pixels, int width, int height) {
+    assert(capture.valid && pixels);
+    thread_mutex_lock(capture.lock);
+    capture.stats.frames++;
+    _capture_acquire_cur();
+    if (capture.cur < 0) {
+        capture.dropped_frames++;
+        capture.stats.dropped_frames++;
+        thread_mutex_unlock(capture.lock);
+        return;
+    }
+    thread_mutex_unlock(capture.lock);
+
+    // the item isn't visible to the writer until it is queued, so copy without the lock
+    _capture_item_t* item = &capture.items[capture.cur];
+    const int copy_width = (width < capture.width) ? width : capture.width;
+    for (int y = 0; y < capture.height; y++) {
+        uint32_t* dst = item->pixels + y * capture.width;
+        if (y < height) {
+            memcpy(dst, pixels + y * width, (size_t)copy_width * sizeof(uint32_t));
+            memset(dst + copy_width, 0, (size_t)(capture.width - copy_width) * sizeof(uint32_t));
+        }
+        else {
+            memset(dst, 0, (size_t)capture.width * sizeof(uint32_t));
+        }
+    }
+    item->has_frame = true;
+
+    thread_mutex_lock(capture.lock);
+    _capture_queue_cur();
+    thread_mutex_unlock(capture.lock);
+}
+
+void capture_audio(const float* samples, int num_samples) {
+    assert(capture.valid && samples);
+    if (!capture.audio_fp) {
+        return;
+    }
+    thread_mutex_lock(capture.lock);
+    capture.stats.samples += (uint64_t)num_samples;
+    while (num_samples > 0) {
+        _capture_acquire_cur();
+        if (capture.cur < 0) {
+            capture.dropped_samples += num_samples;
+            break;
+        }
+        _capture_item_t* item = &capture.items[capture.cur];
+        int n = CAPTURE_MAX_AUDIO_SAMPLES - item->num_samples;
+        n = (num_samples < n) ? num_samples : n;
+        memcpy(item->samples + item->num_samples, samples, (size_t)n * sizeof(float));
+        item->num_samples += n;
+        samples += n;
+        num_samples -= n;
+        if (item->num_samples == CAPTURE_MAX_AUDIO_SAMPLES) {
+            // no frame in a long time (e.g. stopped in the debugger), flush as audio-only item
+            _capture_queue_cur();
+        }
+    }
+    thread_mutex_unlock(capture.lock);
+}
+
+void capture_shutdown(void) {
+    assert(capture.valid);
+    // queue the pending audio and dropped frames, this may wait for the writer
+    for (;;) {
+        thread_mutex_lock(capture.lock);
+        const bool pending = (capture.dropped_frames > 0) || (capture.dropped_samples > 0) ||
+                             ((capture.cur >= 0) && (capture.items[capture.cur].num_samples > 0));
+        if (pending && (capture.cur < 0)) {
+            capture.cur = _capture_alloc_item();
+        }
+        const bool done = !pending || (capture.cur >= 0);
+        if (pending && done) {
+            _capture_queue_cur();
+        }
+        thread_mutex_unlock(capture.lock);
+        if (done) {
+            break;
+        }
+        thread_sleep_us(_CAPTURE_IDLE_SLEEP_US);
+    }
+    thread_atomic_store(&capture.quit, 1);
+    thread_join(capture.thread);
+    thread_mutex_destroy(capture.lock);
+    _capture_close(capture.video_fp);
+    if (capture.audio_fp) {
+        // patch the WAV header sizes, not possible when streaming to a pipe
+        if ((capture.audio_fp != stdout) && (0 == fseek(capture.audio_fp, 0, SEEK_SET))) {
+            _capture_write_wav_header(capture.audio_fp, capture.sample_rate, (uint32_t)(capture.stats.samples * 2));
+        }
+        _capture_close(capture.audio_fp);
+    }
+    for (int i = 0; i < capture.num_items; i++) {
+        free(capture.items[i].pixels);
+    }
+    free(capture.items);
+    free(capture.out);
+    capture.valid = false;
+}
+
+capture_stats_t capture_stats(void) {
+    assert(capture.valid);
+    thread_mutex_lock(capture.lock);
+    capture_stats_t stats = capture.stats;
+    stats.buffers_in_use = capture.num_items - capture.num_free;
+    thread_mutex_unlock(capture.lock);
+    return stats;
+}
+#endif /* COMMON_IMPL */
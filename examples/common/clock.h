@@ -1,19 +1,42 @@
 #pragma once
 /*
     Emulator frame timing helper functions.
+
+    The emulated frame time can be nudged by a small ratio (at most +/-0.5%)
+    to keep the audio buffer fill level steady, otherwise any mismatch between
+    display refresh rate and audio sample rate accumulates until the audio
+    buffer under- or overruns.
 */
 void clock_init(void);
 uint32_t clock_frame_time(void);
+/* use a fixed emulated frame time instead of the wall-clock frame duration (0 to disable) */
+void clock_set_fixed_frame_time(uint32_t frame_time_us);
+/* feed the current audio buffer fill level to the rate controller, call once per frame */
+void clock_rate_control(int fill, int target_fill);
+/* current rate correction factor applied to the frame time (1.0: no correction),
+   can be called from any thread */
+double clock_rate_correction(void);
 uint32_t clock_frame_count_60hz(void);
 
 /*== IMPLEMENTATION ==========================================================*/
 #ifdef COMMON_IMPL
 #include "sokol_app.h"
+#include "thread.h"
 #include <assert.h>
 
+// max deviation of the emulated from the real time
+#define CLOCK_MAX_RATE_DEVIATION (0.005)
+// low-pass filter factor for the audio buffer fill level
+#define CLOCK_FILL_FILTER (0.05)
+
 typedef struct {
     bool valid;
     uint64_t cur_time;
+    uint32_t fixed_frame_time;
+    double avg_fill;
+    double rate_correction;
+    volatile int rate_ppm;      // rate correction in parts per million, published for other threads
+    double frac_time;
 } clock_state_t;
 static clock_state_t clck;
 
@@ -21,17 +44,58 @@ void clock_init(void) {
     clck = (clock_state_t) {
         .valid = true,
         .cur_time = 0,
+        .rate_correction = 1.0,
     };
 }
 
+void clock_set_fixed_frame_time(uint32_t frame_time_us) {
+    assert(clck.valid);
+    clck.fixed_frame_time = frame_time_us;
+}
+
+void clock_rate_control(int fill, int target_fill) {
+    assert(clck.valid);
+    if (target_fill <= 0) {
+        clck.rate_correction = 1.0;
+        thread_atomic_store(&clck.rate_ppm, 0);
+        return;
+    }
+    // the fill level jumps by a whole audio packet whenever the audio callback
+    // runs, so only react to the smoothed fill level
+    clck.avg_fill += ((double)fill - clck.avg_fill) * CLOCK_FILL_FILTER;
+    double err = ((double)target_fill - clck.avg_fill) / (double)target_fill;
+    if (err > 1.0) {
+        err = 1.0;
+    }
+    else if (err < -1.0) {
+        err = -1.0;
+    }
+    // buffer running low: emulate slightly faster, and vice versa
+    clck.rate_correction = 1.0 + err * CLOCK_MAX_RATE_DEVIATION;
+    thread_atomic_store(&clck.rate_ppm, (int) (err * CLOCK_MAX_RATE_DEVIATION * 1000000.0));
+}
+
+double clock_rate_correction(void) {
+    assert(clck.valid);
+    return 1.0 + (double)thread_atomic_load(&clck.rate_ppm) * 0.000001;
+}
+
 uint32_t clock_frame_time(void) {
     assert(clck.valid);
+    if (clck.fixed_frame_time > 0) {
+        clck.cur_time += clck.fixed_frame_time;
+        return clck.fixed_frame_time;
+    }
     uint32_t frame_time_us = (uint32_t) (sapp_frame_duration() * 1000000.0);
     // prevent death-spiral on host systems that are too slow to emulate
     // in real time, or during long frames (e.g. debugging)
     if (frame_time_us > 24000) {
         frame_time_us = 24000;
     }
+    // apply rate correction, carrying the fractional microseconds over to the next frame
+    const double corrected_time_us = (double)frame_time_us * clck.rate_correction + clck.frac_time;
+    frame_time_us = (uint32_t) corrected_time_us;
+    clck.frac_time = corrected_time_us - (double)frame_time_us;
     clck.cur_time += frame_time_us;
     return frame_time_us;
 }
@@ -6,4 +6,8 @@
 #include "gfx.h"
 #include "keybuf.h"
 #include "prof.h"
+#include "thread.h"
+#include "audio.h"
+#include "rewind.h"
+#include "capture.h"
 
@@ -10,4 +10,8 @@
 #include "fs.h"
 #include "gfx.h"
 #include "keybuf.h"
+#include "audio.h"
+#include "thread.h"
+#include "rewind.h"
+#include "capture.h"
 #include <ctype.h> // isupper, islower, toupper, tolower
@@ -10,6 +10,7 @@ bool fs_load_base64(const char* name, const char* payload);
 void fs_load_mem(const char* path, const uint8_t* ptr, uint32_t size);
 uint32_t fs_size(void);
 const uint8_t* fs_ptr(void);
+bool fs_failed(void);
 void fs_reset(void);
 bool fs_ext(const char* str);
 const char* fs_filename(void);
@@ -32,6 +33,7 @@ typedef struct {
     char ext[FS_EXT_SIZE];
     uint8_t* ptr;
     uint32_t size;
+    bool failed;
     uint8_t buf[FS_MAX_SIZE + 1];
 } fs_state_t;
 static fs_state_t fs;
@@ -158,6 +160,7 @@ void fs_reset(void) {
     assert(fs.valid);
     fs.ptr = 0;
     fs.size = 0;
+    fs.failed = false;
 }
 
 void fs_load_mem(const char* path, const uint8_t* ptr, uint32_t size) {
@@ -195,7 +198,9 @@ static void fs_fetch_callback(const sfetch_response_t* response) {
         // in case it's a text file, zero-terminate the data
         fs.buf[fs.size] = 0;
     }
-    // FIXME: signal failure
+    else if (response->failed) {
+        fs.failed = true;
+    }
 }
 
 #if defined(__EMSCRIPTEN__)
@@ -207,7 +212,9 @@ static void fs_emsc_dropped_file_callback(const sapp_html5_fetch_response* respo
         // in case it's a text file, zero-terminate the data
         fs.buf[fs.size] = 0;
     }
-    // FIXME: signal failure
+    else {
+        fs.failed = true;
+    }
 }
 #endif
 
@@ -245,6 +252,11 @@ const uint8_t* fs_ptr(void) {
     return fs.ptr;
 }
 
+bool fs_failed(void) {
+    assert(fs.valid);
+    return fs.failed;
+}
+
 uint32_t fs_size(void) {
     assert(fs.valid);
     return fs.size;
@@ -14,8 +14,13 @@
 extern "C" {
 #endif
 
-#define GFX_MAX_FB_WIDTH (1024)
+#define GFX_MAX_FB_WIDTH (1024)     // default max emulator framebuffer size
 #define GFX_MAX_FB_HEIGHT (1024)
+#define GFX_MAX_PALETTE_COLORS (256)
+#define GFX_MAX_STREAM_IMAGES (4)
+#define GFX_MAX_TILES (16)          // max number of emulator instances displayed side by side
+#define GFX_ZX_VRAM_SIZE (6912)     // ZX Spectrum bitmap + attributes
+#define GFX_ZX_MAX_LINES (256)      // max number of display lines in the ZX border log
 
 typedef struct {
     int border_top;
@@ -25,13 +30,53 @@ typedef struct {
     int emu_aspect_x;
     int emu_aspect_y;
     bool rot90;
+    bool triple_buffer;     // set when the emulator runs on its own thread (see gfx_framebuffer_publish)
+    const uint32_t* palette;    // optional: the emulator's colors, enables the 8-bit indexed texture path
+    int palette_size;           // number of colors in palette (max GFX_MAX_PALETTE_COLORS)
+    bool zx_decode;             // decode the ZX screen on the GPU from gfx_zx_screen() data (needs palette)
+    bool two_pass;              // use the 2x upscale render target pass instead of single-pass sharp-bilinear filtering
+    int max_fb_width;           // max emulator framebuffer size (default: GFX_MAX_FB_WIDTH/HEIGHT)
+    int max_fb_height;
+    int stream_images;          // number of rotating framebuffer textures (default: 3, max GFX_MAX_STREAM_IMAGES)
+    uint32_t* framebuffer;      // optional: caller-provided framebuffer, otherwise it's allocated
+    size_t framebuffer_size;    // size of the caller-provided framebuffer in bytes
+    int num_tiles;              // number of emulator instances displayed as tiles (default: 1, max GFX_MAX_TILES)
     void (*draw_extra_cb)(void);
 } gfx_desc_t;
 
 void gfx_init(const gfx_desc_t* desc);
 uint32_t* gfx_framebuffer(void);
 size_t gfx_framebuffer_size(void);
+/* called on the emulator thread after each exec slice when triple-buffering is
+   enabled, copies the framebuffer content into a free slot which gfx_draw()
+   then picks up without locking
+*/
+void gfx_framebuffer_publish(int emu_width, int emu_height);
+/* the framebuffer of an emulator tile, tile 0 is gfx_framebuffer() */
+uint32_t* gfx_tile_framebuffer(int tile);
+/* same as gfx_framebuffer_publish() for an emulator tile, tiles other than
+   0 are always triple-buffered and expected to run on their own thread
+*/
+void gfx_tile_publish(int tile, int emu_width, int emu_height);
+/* number of emulator tiles */
+int gfx_num_tiles(void);
+/* emu_width/height is the display size of each emulator tile, all tiles
+   are gathered into one texture atlas which is uploaded and drawn at once
+*/
 void gfx_draw(int emu_width, int emu_height);
+/* change the displayed colors in indexed mode (colors[i] replaces desc.palette[i]) */
+void gfx_set_palette(const uint32_t* colors, int num_colors);
+/* true if the framebuffer is uploaded as 8-bit palette indices */
+bool gfx_indexed(void);
+/* true if the ZX screen is decoded on the GPU, gfx_draw() then ignores the framebuffer */
+bool gfx_zx_decode(void);
+/* provide the raw ZX video memory, the border palette index of each
+   display line and the flash phase for the next gfx_draw(), screen_x/y is
+   the top-left corner of the 256x192 screen area in the display
+*/
+void gfx_zx_screen(const uint8_t* vram, const uint8_t* border_lines, int num_lines, bool flash, int screen_x, int screen_y);
+/* number of frames where gfx_draw() skipped the texture upload because nothing changed */
+uint32_t gfx_skipped_uploads(void);
 void gfx_shutdown(void);
 void* gfx_create_texture(int w, int h);
 void gfx_update_texture(void* h, void* data, int data_byte_size);
@@ -53,10 +98,17 @@ void gfx_flash_error(void);
 #include "sokol_audio.h"
 #include "sokol_glue.h"
 #include "shaders.glsl.h"
+#include "sokol_time.h"
+#include "thread.h"
+#include "prof.h"
 #include <assert.h>
 #include <stdlib.h> // malloc/free
+#include <string.h> // memcpy
+#include <math.h>   // floorf
 
 #define _GFX_DEF(v,def) (v?v:def)
+#define _GFX_TRIPLEBUF_FRESH (4)
+#define _GFX_FB_ALIGN (64)
 
 typedef struct {
     bool valid;
@@ -67,7 +119,10 @@ typedef struct {
         int right;
     } border;
     struct {
-        sg_image img;
+        sg_image img;           // the most recently updated image in imgs[]
+        sg_image imgs[GFX_MAX_STREAM_IMAGES];
+        int num_imgs;
+        int cur_img;
         int aspect_x;
         int aspect_y;
         int width;
@@ -85,6 +140,12 @@ typedef struct {
         sg_pipeline pip;
         sg_pass_action pass_action;
         bool rot90;
+        bool single_pass;       // sample the emulator framebuffer directly, no upscale pass
+        sg_buffer direct_vbuf;  // texture coordinates for sampling the (not flipped) emulator framebuffer
+        sg_pipeline sharp_pip;
+        sg_pipeline sharp_indexed_pip;
+        float vp_width;         // size of the display viewport
+        float vp_height;
     } display;
     struct {
         sg_image img;
@@ -92,10 +153,57 @@ typedef struct {
         int width;
         int height;
     } icon;
+    struct {
+        int num;                // number of emulator instances, each with its own framebuffer
+        int cols;               // grid layout of the tiles, both in the texture atlas and on screen
+        int rows;
+        int width;              // size of one tile (the emulator display size)
+        int height;
+        int gutter;             // texels between neighbouring tiles in the atlas (0 for a single tile)
+    } tiles;
+    struct {
+        bool enabled;
+        uint32_t* buffers[3];
+        int write_index;        // only accessed on the emulator thread
+        int read_index;         // only accessed on the render thread
+        volatile int shared;    // slot handed between threads, with _GFX_TRIPLEBUF_FRESH bit if not yet drawn
+    } tribuf[GFX_MAX_TILES];
+    struct {
+        uint32_t* shadow;       // copy of the last uploaded frame (the texture atlas with all tiles)
+        bool force;             // upload the next frame even if unchanged
+        uint32_t num_skipped;   // number of frames where the upload was skipped
+    } dirty;
+    struct {
+        bool enabled;
+        int num_colors;
+        uint32_t colors[GFX_MAX_PALETTE_COLORS];    // the emulator's colors, RGBA pixels are matched against these
+        uint32_t display_colors[GFX_MAX_PALETTE_COLORS];
+        bool palette_dirty;
+        uint8_t last_index;     // most recent match, runs of the same color are common
+        uint8_t* pixels;        // palette indices of the last uploaded frame
+        sg_image pal_img;
+        sg_pipeline pip;
+    } indexed;
+    struct {
+        bool enabled;
+        bool dirty;             // the screen data has changed since the last upload
+        uint8_t data[256 * 28]; // rows 0..26: video memory, row 27: border log
+        zxdecode_params_t params;
+        sg_image img;           // the most recently updated image in imgs[]
+        sg_image imgs[GFX_MAX_STREAM_IMAGES];
+        int cur_img;
+        sg_pipeline pip;
+    } zxdecode;
     int flash_success_count;
     int flash_error_count;
-    
-    uint32_t rgba8_buffer[GFX_MAX_FB_WIDTH * GFX_MAX_FB_HEIGHT];
+    struct {
+        uint32_t* ptr;          // the framebuffer the emulator renders into (tile 0)
+        uint32_t* tile_ptrs[GFX_MAX_TILES];
+        size_t size;            // size in bytes of one tile's framebuffer
+        int max_width;
+        int max_height;
+        void* alloc;            // unaligned allocation if not provided by the caller
+    } fb;
     void (*draw_extra_cb)(void);
 } gfx_state_t;
 
@@ -202,32 +310,224 @@ void gfx_flash_error(void) {
 
 uint32_t* gfx_framebuffer(void) {
     assert(gfx.valid);
-    return gfx.rgba8_buffer;
+    return gfx.fb.ptr;
 }
 
 size_t gfx_framebuffer_size(void) {
     assert(gfx.valid);
-    return sizeof(gfx.rgba8_buffer);
+    return gfx.fb.size;
+}
+
+void gfx_framebuffer_publish(int emu_width, int emu_height) {
+    gfx_tile_publish(0, emu_width, emu_height);
+}
+
+uint32_t* gfx_tile_framebuffer(int tile) {
+    assert(gfx.valid && (tile >= 0) && (tile < gfx.tiles.num));
+    return gfx.fb.tile_ptrs[tile];
+}
+
+void gfx_tile_publish(int tile, int emu_width, int emu_height) {
+    assert(gfx.valid && (tile >= 0) && (tile < gfx.tiles.num) && gfx.tribuf[tile].enabled);
+    assert((emu_width <= gfx.fb.max_width) && (emu_height <= gfx.fb.max_height));
+    uint32_t* dst = gfx.tribuf[tile].buffers[gfx.tribuf[tile].write_index];
+    memcpy(dst, gfx.fb.tile_ptrs[tile], (size_t)(emu_width * emu_height) * sizeof(uint32_t));
+    const int prev = thread_atomic_exchange(&gfx.tribuf[tile].shared, gfx.tribuf[tile].write_index | _GFX_TRIPLEBUF_FRESH);
+    gfx.tribuf[tile].write_index = prev & 3;
+}
+
+int gfx_num_tiles(void) {
+    assert(gfx.valid);
+    return gfx.tiles.num;
+}
+
+void gfx_set_palette(const uint32_t* colors, int num_colors) {
+    assert(gfx.valid && colors);
+    assert((num_colors >= 0) && (num_colors <= GFX_MAX_PALETTE_COLORS));
+    memcpy(gfx.indexed.display_colors, colors, (size_t)num_colors * sizeof(uint32_t));
+    gfx.indexed.palette_dirty = true;
+}
+
+bool gfx_indexed(void) {
+    assert(gfx.valid);
+    return gfx.indexed.enabled;
+}
+
+bool gfx_zx_decode(void) {
+    assert(gfx.valid);
+    return gfx.zxdecode.enabled;
+}
+
+void gfx_zx_screen(const uint8_t* vram, const uint8_t* border_lines, int num_lines, bool flash, int screen_x, int screen_y) {
+    assert(gfx.valid && gfx.zxdecode.enabled && vram && border_lines);
+    assert((num_lines > 0) && (num_lines <= GFX_ZX_MAX_LINES));
+    uint8_t* border_dst = gfx.zxdecode.data + 27 * 256;
+    const float flash_val = flash ? 1.0f : 0.0f;
+    if ((0 != memcmp(gfx.zxdecode.data, vram, GFX_ZX_VRAM_SIZE)) ||
+        (0 != memcmp(border_dst, border_lines, (size_t)num_lines)) ||
+        (flash_val != gfx.zxdecode.params.flash) ||
+        ((float)screen_x != gfx.zxdecode.params.screen_pos[0]) ||
+        ((float)screen_y != gfx.zxdecode.params.screen_pos[1]))
+    {
+        memcpy(gfx.zxdecode.data, vram, GFX_ZX_VRAM_SIZE);
+        memcpy(border_dst, border_lines, (size_t)num_lines);
+        gfx.zxdecode.params.flash = flash_val;
+        gfx.zxdecode.params.screen_pos[0] = (float)screen_x;
+        gfx.zxdecode.params.screen_pos[1] = (float)screen_y;
+        gfx.zxdecode.dirty = true;
+    }
+}
+
+uint32_t gfx_skipped_uploads(void) {
+    assert(gfx.valid);
+    return gfx.dirty.num_skipped;
+}
+
+// get a tile's pixel data to upload, this is the newest published slot when triple-buffered,
+// returns a null pointer if no new frame has been published since the last call
+static const uint32_t* gfx_upload_source(int tile) {
+    if (!gfx.tribuf[tile].enabled) {
+        return gfx.fb.tile_ptrs[tile];
+    }
+    if (thread_atomic_load(&gfx.tribuf[tile].shared) & _GFX_TRIPLEBUF_FRESH) {
+        const int prev = thread_atomic_exchange(&gfx.tribuf[tile].shared, gfx.tribuf[tile].read_index);
+        gfx.tribuf[tile].read_index = prev & 3;
+        return gfx.tribuf[tile].buffers[gfx.tribuf[tile].read_index];
+    }
+    return 0;
+}
+
+static void gfx_init_images_and_pass(void);
+
+/* convert a line of RGBA pixels into palette indices, returns false if a
+   color isn't in the palette
+*/
+static bool gfx_index_line(uint8_t* dst, const uint32_t* src, int width) {
+    uint8_t idx = gfx.indexed.last_index;
+    for (int x = 0; x < width; x++) {
+        const uint32_t c = src[x];
+        if (c != gfx.indexed.colors[idx]) {
+            int i = 0;
+            while ((i < gfx.indexed.num_colors) && (c != gfx.indexed.colors[i])) {
+                i++;
+            }
+            if (i == gfx.indexed.num_colors) {
+                return false;
+            }
+            idx = (uint8_t)i;
+        }
+        dst[x] = idx;
+    }
+    gfx.indexed.last_index = idx;
+    return true;
+}
+
+/* compare the new frames of all tiles line by line against the last
+   uploaded frame and update the shadow copy (and the indexed copy in
+   indexed mode), this also gathers the tiles into the texture atlas
+   layout and repeats each tile's right column and bottom line into the
+   gutter to its right and below, returns true if any pixel has changed
+*/
+static bool gfx_frame_dirty(void) {
+    bool dirty = gfx.dirty.force;
+    const int width = gfx.tiles.width;
+    const int height = gfx.tiles.height;
+    const int gutter = gfx.tiles.gutter;
+    const int atlas_width = gfx.emufb.width;
+    const size_t line_size = (size_t)width * sizeof(uint32_t);
+    for (int tile = 0; tile < gfx.tiles.num; tile++) {
+        const uint32_t* src = gfx_upload_source(tile);
+        if (!src) {
+            continue;
+        }
+        const int col = tile % gfx.tiles.cols;
+        const int row = tile / gfx.tiles.cols;
+        const int x0 = col * (width + gutter);
+        const int y0 = row * (height + gutter);
+        // number of gutter texels right of and below this tile
+        const int gutter_x = (col < (gfx.tiles.cols - 1)) ? gutter : 0;
+        const int gutter_y = (row < (gfx.tiles.rows - 1)) ? gutter : 0;
+        for (int y = 0; y < height; y++) {
+            const uint32_t* src_line = src + y * width;
+            const int dst_offset = (y0 + y) * atlas_width + x0;
+            uint32_t* dst_line = gfx.dirty.shadow + dst_offset;
+            if (gfx.dirty.force || (0 != memcmp(dst_line, src_line, line_size))) {
+                memcpy(dst_line, src_line, line_size);
+                dirty = true;
+                if (gfx.indexed.enabled && !gfx_index_line(gfx.indexed.pixels + dst_offset, src_line, width)) {
+                    // the emulator produced a color outside the palette, fall back to RGBA textures
+                    gfx.indexed.enabled = false;
+                    gfx_init_images_and_pass();
+                }
+                for (int x = 0; x < gutter_x; x++) {
+                    dst_line[width + x] = dst_line[width - 1];
+                    if (gfx.indexed.enabled) {
+                        gfx.indexed.pixels[dst_offset + width + x] = gfx.indexed.pixels[dst_offset + width - 1];
+                    }
+                }
+                if (y == (height - 1)) {
+                    for (int i = 1; i <= gutter_y; i++) {
+                        const int gutter_offset = dst_offset + i * atlas_width;
+                        memcpy(gfx.dirty.shadow + gutter_offset, dst_line, (size_t)(width + gutter_x) * sizeof(uint32_t));
+                        if (gfx.indexed.enabled) {
+                            memcpy(gfx.indexed.pixels + gutter_offset, gfx.indexed.pixels + dst_offset, (size_t)(width + gutter_x));
+                        }
+                    }
+                }
+            }
+        }
+    }
+    return dirty;
+}
+
+/* update the next image in a ring of stream images, so that the CPU
+   doesn't write into a texture the GPU may still be sampling from the
+   previous frame (some GL drivers stall on this), the upload time goes
+   into the PROF_UPLOAD profiler bucket
+*/
+static sg_image gfx_update_stream_image(sg_image* imgs, int num_imgs, int* cur_img, const void* ptr, size_t size) {
+    *cur_img = (*cur_img + 1) % num_imgs;
+    const uint64_t start_time = stm_now();
+    prof_begin("sg_update_image");
+    sg_update_image(imgs[*cur_img], &(sg_image_data){
+        .subimage[0][0] = { .ptr = ptr, .size = size }
+    });
+    prof_end();
+    prof_push(PROF_UPLOAD, (float)stm_ms(stm_since(start_time)));
+    return imgs[*cur_img];
 }
 
 static void gfx_init_images_and_pass(void) {
     // destroy previous resources (if exist)
-    sg_destroy_image(gfx.emufb.img);
+    for (int i = 0; i < gfx.emufb.num_imgs; i++) {
+        sg_destroy_image(gfx.emufb.imgs[i]);
+    }
     sg_destroy_image(gfx.upscale.img);
     sg_destroy_pass(gfx.upscale.pass);
 
-    // a texture with the emulator's raw pixel data
-    gfx.emufb.img = sg_make_image(&(sg_image_desc){
-        .width = gfx.emufb.width,
-        .height = gfx.emufb.height,
-        .pixel_format = SG_PIXELFORMAT_RGBA8,
-        .usage = SG_USAGE_STREAM,
-        .min_filter = SG_FILTER_NEAREST,
-        .mag_filter = SG_FILTER_NEAREST,
-        .wrap_u = SG_WRAP_CLAMP_TO_EDGE,
-        .wrap_v = SG_WRAP_CLAMP_TO_EDGE
-    });
-    
+    // textures with the emulator's raw pixel data, linear filtering
+    // for the single-pass sharp-bilinear shader (except for palette indices)
+    const bool linear = gfx.display.single_pass && !gfx.indexed.enabled;
+    for (int i = 0; i < gfx.emufb.num_imgs; i++) {
+        gfx.emufb.imgs[i] = sg_make_image(&(sg_image_desc){
+            .width = gfx.emufb.width,
+            .height = gfx.emufb.height,
+            .pixel_format = gfx.indexed.enabled ? SG_PIXELFORMAT_R8 : SG_PIXELFORMAT_RGBA8,
+            .usage = SG_USAGE_STREAM,
+            .min_filter = linear ? SG_FILTER_LINEAR : SG_FILTER_NEAREST,
+            .mag_filter = linear ? SG_FILTER_LINEAR : SG_FILTER_NEAREST,
+            .wrap_u = SG_WRAP_CLAMP_TO_EDGE,
+            .wrap_v = SG_WRAP_CLAMP_TO_EDGE
+        });
+    }
+    gfx.emufb.cur_img = 0;
+    gfx.emufb.img = gfx.emufb.imgs[0];
+
+    // the new textures have no content yet
+    gfx.dirty.force = true;
+    if (gfx.display.single_pass) {
+        return;
+    }
     
     // 2x-upscaling render target textures and passes
     gfx.upscale.img = sg_make_image(&(sg_image_desc){
@@ -276,6 +576,8 @@ void gfx_init(const gfx_desc_t* desc) {
     gfx.emufb.height = 0;
     gfx.emufb.aspect_x = _GFX_DEF(desc->emu_aspect_x, 1);
     gfx.emufb.aspect_y = _GFX_DEF(desc->emu_aspect_y, 1);
+    gfx.emufb.num_imgs = _GFX_DEF(desc->stream_images, 3);
+    assert((gfx.emufb.num_imgs > 0) && (gfx.emufb.num_imgs <= GFX_MAX_STREAM_IMAGES));
     
     gfx.upscale.pass_action = (sg_pass_action) {
         .colors[0] = { .action = SG_ACTION_DONTCARE }
@@ -318,6 +620,160 @@ void gfx_init(const gfx_desc_t* desc) {
     });
     gfx.display.rot90 = desc->rot90;
     gfx.draw_extra_cb = desc->draw_extra_cb;
+
+    // emulator tiles in a grid that is as square as possible
+    gfx.tiles.num = _GFX_DEF(desc->num_tiles, 1);
+    assert((gfx.tiles.num > 0) && (gfx.tiles.num <= GFX_MAX_TILES));
+    gfx.tiles.cols = 1;
+    while ((gfx.tiles.cols * gfx.tiles.cols) < gfx.tiles.num) {
+        gfx.tiles.cols++;
+    }
+    gfx.tiles.rows = (gfx.tiles.num + gfx.tiles.cols - 1) / gfx.tiles.cols;
+    // the linear filtering of the display would blend the edge texels of
+    // neighbouring tiles, a gutter filled with the tile's own edge texels
+    // separates them
+    gfx.tiles.gutter = (gfx.tiles.num > 1) ? 1 : 0;
+
+    // the emulator framebuffers (one per tile), sized for the largest display the
+    // emulator will produce, caller-provided or allocated with cache-line alignment
+    gfx.fb.max_width = _GFX_DEF(desc->max_fb_width, GFX_MAX_FB_WIDTH);
+    gfx.fb.max_height = _GFX_DEF(desc->max_fb_height, GFX_MAX_FB_HEIGHT);
+    gfx.fb.size = (size_t)(gfx.fb.max_width * gfx.fb.max_height) * sizeof(uint32_t);
+    gfx.fb.size = ((gfx.fb.size + _GFX_FB_ALIGN - 1) / _GFX_FB_ALIGN) * _GFX_FB_ALIGN;
+    if (desc->framebuffer) {
+        assert((gfx.tiles.num == 1) && (desc->framebuffer_size >= gfx.fb.size));
+        gfx.fb.ptr = desc->framebuffer;
+        gfx.fb.size = desc->framebuffer_size;
+    }
+    else {
+        gfx.fb.alloc = calloc(1, (size_t)gfx.tiles.num * gfx.fb.size + _GFX_FB_ALIGN);
+        assert(gfx.fb.alloc);
+        gfx.fb.ptr = (uint32_t*) (((uintptr_t)gfx.fb.alloc + (_GFX_FB_ALIGN - 1)) & ~(uintptr_t)(_GFX_FB_ALIGN - 1));
+    }
+    for (int i = 0; i < gfx.tiles.num; i++) {
+        gfx.fb.tile_ptrs[i] = (uint32_t*) ((uint8_t*)gfx.fb.ptr + (size_t)i * gfx.fb.size);
+    }
+    // size of the texture atlas with all tiles
+    const size_t atlas_pixels = (size_t)(gfx.tiles.cols * (gfx.fb.max_width + gfx.tiles.gutter)) *
+                                (size_t)(gfx.tiles.rows * (gfx.fb.max_height + gfx.tiles.gutter));
+
+    // single-pass sharp-bilinear display, samples the emulator framebuffer
+    // texture directly, its first row is the top line on all backends (unlike
+    // a render target)
+    gfx.display.single_pass = !desc->two_pass;
+    if (gfx.display.single_pass) {
+        gfx.display.direct_vbuf = sg_make_buffer(&(sg_buffer_desc){
+            .data = {
+                .ptr = desc->rot90 ? gfx_verts_flipped_rot : gfx_verts_flipped,
+                .size = sizeof(gfx_verts)
+            }
+        });
+        gfx.display.sharp_pip = sg_make_pipeline(&(sg_pipeline_desc){
+            .shader = sg_make_shader(display_sharp_shader_desc(sg_query_backend())),
+            .layout = {
+                .attrs = {
+                    [0].format = SG_VERTEXFORMAT_FLOAT2,
+                    [1].format = SG_VERTEXFORMAT_FLOAT2
+                }
+            },
+            .primitive_type = SG_PRIMITIVETYPE_TRIANGLE_STRIP
+        });
+        gfx.display.sharp_indexed_pip = sg_make_pipeline(&(sg_pipeline_desc){
+            .shader = sg_make_shader(display_sharp_indexed_shader_desc(sg_query_backend())),
+            .layout = {
+                .attrs = {
+                    [0].format = SG_VERTEXFORMAT_FLOAT2,
+                    [1].format = SG_VERTEXFORMAT_FLOAT2
+                }
+            },
+            .primitive_type = SG_PRIMITIVETYPE_TRIANGLE_STRIP
+        });
+    }
+
+    // optional triple-buffering for emulators running on their own thread,
+    // the additional tiles always run on their own threads
+    for (int tile = 0; tile < gfx.tiles.num; tile++) {
+        if (desc->triple_buffer || (tile > 0)) {
+            gfx.tribuf[tile].enabled = true;
+            for (int i = 0; i < 3; i++) {
+                gfx.tribuf[tile].buffers[i] = calloc(1, gfx.fb.size);
+                assert(gfx.tribuf[tile].buffers[i]);
+            }
+            gfx.tribuf[tile].write_index = 0;
+            gfx.tribuf[tile].shared = 1;
+            gfx.tribuf[tile].read_index = 2;
+        }
+    }
+
+    // shadow copy of the last uploaded frame to detect unchanged frames
+    gfx.dirty.shadow = calloc(atlas_pixels, sizeof(uint32_t));
+    assert(gfx.dirty.shadow);
+    gfx.dirty.force = true;
+
+    // optional 8-bit indexed texture path (needs R8 texture support, not in WebGL1/GLES2),
+    // the palette texture is resolved in the upscale shader
+    if (desc->palette && (desc->palette_size > 0) && sg_query_pixelformat(SG_PIXELFORMAT_R8).sample) {
+        assert(desc->palette_size <= GFX_MAX_PALETTE_COLORS);
+        gfx.indexed.enabled = true;
+        gfx.indexed.num_colors = desc->palette_size;
+        memcpy(gfx.indexed.colors, desc->palette, (size_t)desc->palette_size * sizeof(uint32_t));
+        memcpy(gfx.indexed.display_colors, desc->palette, (size_t)desc->palette_size * sizeof(uint32_t));
+        gfx.indexed.palette_dirty = true;
+        gfx.indexed.pixels = calloc(1, atlas_pixels);
+        assert(gfx.indexed.pixels);
+        gfx.indexed.pal_img = sg_make_image(&(sg_image_desc){
+            .width = GFX_MAX_PALETTE_COLORS,
+            .height = 1,
+            .pixel_format = SG_PIXELFORMAT_RGBA8,
+            .usage = SG_USAGE_DYNAMIC,
+            .min_filter = SG_FILTER_NEAREST,
+            .mag_filter = SG_FILTER_NEAREST,
+            .wrap_u = SG_WRAP_CLAMP_TO_EDGE,
+            .wrap_v = SG_WRAP_CLAMP_TO_EDGE
+        });
+        gfx.indexed.pip = sg_make_pipeline(&(sg_pipeline_desc){
+            .shader = sg_make_shader(upscale_indexed_shader_desc(sg_query_backend())),
+            .layout = {
+                .attrs = {
+                    [0].format = SG_VERTEXFORMAT_FLOAT2,
+                    [1].format = SG_VERTEXFORMAT_FLOAT2
+                }
+            },
+            .primitive_type = SG_PRIMITIVETYPE_TRIANGLE_STRIP,
+            .depth.pixel_format = SG_PIXELFORMAT_NONE
+        });
+
+        // optional ZX screen decoding on the GPU (uses the palette texture,
+        // and renders into the upscale target), only for a single tile
+        if (desc->zx_decode && (gfx.tiles.num == 1)) {
+            gfx.zxdecode.enabled = true;
+            gfx.display.single_pass = false;
+            for (int i = 0; i < gfx.emufb.num_imgs; i++) {
+                gfx.zxdecode.imgs[i] = sg_make_image(&(sg_image_desc){
+                    .width = 256,
+                    .height = 28,
+                    .pixel_format = SG_PIXELFORMAT_R8,
+                    .usage = SG_USAGE_STREAM,
+                    .min_filter = SG_FILTER_NEAREST,
+                    .mag_filter = SG_FILTER_NEAREST,
+                    .wrap_u = SG_WRAP_CLAMP_TO_EDGE,
+                    .wrap_v = SG_WRAP_CLAMP_TO_EDGE
+                });
+            }
+            gfx.zxdecode.img = gfx.zxdecode.imgs[0];
+            gfx.zxdecode.pip = sg_make_pipeline(&(sg_pipeline_desc){
+                .shader = sg_make_shader(zxdecode_shader_desc(sg_query_backend())),
+                .layout = {
+                    .attrs = {
+                        [0].format = SG_VERTEXFORMAT_FLOAT2,
+                        [1].format = SG_VERTEXFORMAT_FLOAT2
+                    }
+                },
+                .primitive_type = SG_PRIMITIVETYPE_TRIANGLE_STRIP,
+                .depth.pixel_format = SG_PIXELFORMAT_NONE
+            });
+        }
+    }
     
     // create an unpacked speaker icon image and sokol-gl pipeline
     {
@@ -402,18 +858,81 @@ static void apply_viewport(int canvas_width, int canvas_height) {
         vp_h = (cw / emu_aspect);
         vp_y = (float)gfx.border.top;
     }
+    gfx.display.vp_width = vp_w;
+    gfx.display.vp_height = vp_h;
     sg_apply_viewportf(vp_x, vp_y, vp_w, vp_h, true);
 }
 
+// upscale the emulator framebuffer texture 2x into the upscale render target
+static void gfx_draw_upscale_pass(void) {
+    sg_begin_pass(gfx.upscale.pass, &gfx.upscale.pass_action);
+    if (gfx.indexed.enabled) {
+        sg_apply_pipeline(gfx.indexed.pip);
+        sg_apply_bindings(&(sg_bindings){
+            .vertex_buffers[0] = gfx.upscale.vbuf,
+            .fs_images = {
+                [SLOT_idx_tex] = gfx.emufb.img,
+                [SLOT_pal_tex] = gfx.indexed.pal_img,
+            }
+        });
+    }
+    else {
+        sg_apply_pipeline(gfx.upscale.pip);
+        sg_apply_bindings(&(sg_bindings){
+            .vertex_buffers[0] = gfx.upscale.vbuf,
+            .fs_images[SLOT_emufb_tex] = gfx.emufb.img,
+        });
+    }
+    sg_draw(0, 4, 1);
+    sg_end_pass();
+}
+
+// apply pipeline, bindings and uniforms for the single-pass sharp-bilinear display
+static void gfx_draw_sharp(void) {
+    // with 90 degree rotation, the texture's width is along the viewport's height
+    const float vp_w = gfx.display.rot90 ? gfx.display.vp_height : gfx.display.vp_width;
+    const float vp_h = gfx.display.rot90 ? gfx.display.vp_width : gfx.display.vp_height;
+    float prescale_x = floorf(vp_w / (float)gfx.emufb.width);
+    float prescale_y = floorf(vp_h / (float)gfx.emufb.height);
+    const sharp_params_t params = {
+        .tex_size = { (float)gfx.emufb.width, (float)gfx.emufb.height },
+        .prescale = { (prescale_x < 1.0f) ? 1.0f : prescale_x, (prescale_y < 1.0f) ? 1.0f : prescale_y },
+    };
+    if (gfx.indexed.enabled) {
+        sg_apply_pipeline(gfx.display.sharp_indexed_pip);
+        sg_apply_bindings(&(sg_bindings){
+            .vertex_buffers[0] = gfx.display.direct_vbuf,
+            .fs_images = {
+                [SLOT_sharp_idx_tex] = gfx.emufb.img,
+                [SLOT_sharp_pal_tex] = gfx.indexed.pal_img,
+            }
+        });
+        sg_apply_uniforms(SG_SHADERSTAGE_FS, SLOT_sharp_indexed_params, &SG_RANGE(params));
+    }
+    else {
+        sg_apply_pipeline(gfx.display.sharp_pip);
+        sg_apply_bindings(&(sg_bindings){
+            .vertex_buffers[0] = gfx.display.direct_vbuf,
+            .fs_images[SLOT_sharp_tex] = gfx.emufb.img,
+        });
+        sg_apply_uniforms(SG_SHADERSTAGE_FS, SLOT_sharp_params, &SG_RANGE(params));
+    }
+}
+
 void gfx_draw(int emu_width, int emu_height) {
     assert(gfx.valid);
+    prof_begin("gfx_draw");
     const int w = sapp_width();
     const int h = sapp_height();
     
     // check if emulator framebuffer size has changed, need to create new backing texture
-    if ((emu_width != gfx.emufb.width) || (emu_height != gfx.emufb.height)) {
-        gfx.emufb.width = emu_width;
-        gfx.emufb.height = emu_height;
+    // (the emulator framebuffer texture is the atlas of all tiles)
+    assert((emu_width <= gfx.fb.max_width) && (emu_height <= gfx.fb.max_height));
+    if ((emu_width != gfx.tiles.width) || (emu_height != gfx.tiles.height)) {
+        gfx.tiles.width = emu_width;
+        gfx.tiles.height = emu_height;
+        gfx.emufb.width = gfx.tiles.cols * (emu_width + gfx.tiles.gutter) - gfx.tiles.gutter;
+        gfx.emufb.height = gfx.tiles.rows * (emu_height + gfx.tiles.gutter) - gfx.tiles.gutter;
         gfx_init_images_and_pass();
     }
     
@@ -439,23 +958,60 @@ void gfx_draw(int emu_width, int emu_height) {
         sgl_end();
     }
 
-    // copy emulator pixel data into emulator framebuffer texture
-    sg_update_image(gfx.emufb.img, &(sg_image_data){
-        .subimage[0][0] = {
-            .ptr = gfx.rgba8_buffer,
-            .size = gfx.emufb.width*gfx.emufb.height*sizeof(uint32_t)
+    // copy emulator pixel data into emulator framebuffer texture and (unless
+    // in single-pass mode) upscale it 2x with nearest filtering, both are
+    // skipped if the emulator hasn't changed any pixel (e.g. on title
+    // screens, or stopped in the debugger)
+    if (gfx.indexed.enabled && gfx.indexed.palette_dirty) {
+        gfx.indexed.palette_dirty = false;
+        gfx.dirty.force = true;
+        sg_update_image(gfx.indexed.pal_img, &(sg_image_data){
+            .subimage[0][0] = SG_RANGE(gfx.indexed.display_colors)
+        });
+    }
+    if (gfx.zxdecode.enabled) {
+        // the ZX screen is decoded from video memory, the framebuffer isn't used
+        if (gfx.zxdecode.dirty || gfx.dirty.force) {
+            gfx.zxdecode.dirty = false;
+            gfx.dirty.force = false;
+            gfx.zxdecode.params.fb_size[0] = (float)gfx.emufb.width;
+            gfx.zxdecode.params.fb_size[1] = (float)gfx.emufb.height;
+            gfx.zxdecode.img = gfx_update_stream_image(gfx.zxdecode.imgs, gfx.emufb.num_imgs, &gfx.zxdecode.cur_img,
+                gfx.zxdecode.data, sizeof(gfx.zxdecode.data));
+            sg_begin_pass(gfx.upscale.pass, &gfx.upscale.pass_action);
+            sg_apply_pipeline(gfx.zxdecode.pip);
+            sg_apply_bindings(&(sg_bindings){
+                .vertex_buffers[0] = gfx.upscale.vbuf,
+                .fs_images = {
+                    [SLOT_vram_tex] = gfx.zxdecode.img,
+                    [SLOT_zxpal_tex] = gfx.indexed.pal_img,
+                }
+            });
+            sg_apply_uniforms(SG_SHADERSTAGE_FS, SLOT_zxdecode_params, &SG_RANGE(gfx.zxdecode.params));
+            sg_draw(0, 4, 1);
+            sg_end_pass();
         }
-    });
-    
-    // upscale the original framebuffer 2x with nearest filtering
-    sg_begin_pass(gfx.upscale.pass, &gfx.upscale.pass_action);
-    sg_apply_pipeline(gfx.upscale.pip);
-    sg_apply_bindings(&(sg_bindings){
-        .vertex_buffers[0] = gfx.upscale.vbuf,
-        .fs_images[SLOT_emufb_tex] = gfx.emufb.img,
-    });
-    sg_draw(0, 4, 1);
-    sg_end_pass();
+        else {
+            gfx.dirty.num_skipped++;
+        }
+    }
+    else if (gfx_frame_dirty()) {
+        gfx.dirty.force = false;
+        if (gfx.indexed.enabled) {
+            gfx.emufb.img = gfx_update_stream_image(gfx.emufb.imgs, gfx.emufb.num_imgs, &gfx.emufb.cur_img,
+                gfx.indexed.pixels, (size_t)(gfx.emufb.width*gfx.emufb.height));
+        }
+        else {
+            gfx.emufb.img = gfx_update_stream_image(gfx.emufb.imgs, gfx.emufb.num_imgs, &gfx.emufb.cur_img,
+                gfx.dirty.shadow, (size_t)(gfx.emufb.width*gfx.emufb.height)*sizeof(uint32_t));
+        }
+        if (!gfx.display.single_pass) {
+            gfx_draw_upscale_pass();
+        }
+    }
+    else {
+        gfx.dirty.num_skipped++;
+    }
     
     // tint the clear color red or green if flash feedback is requested
     if (gfx.flash_error_count > 0) {
@@ -474,11 +1030,16 @@ void gfx_draw(int emu_width, int emu_height) {
     // draw the final pass with linear filtering
     sg_begin_default_pass(&gfx.display.pass_action, w, h);
     apply_viewport(w, h);
-    sg_apply_pipeline(gfx.display.pip);
-    sg_apply_bindings(&(sg_bindings){
-        .vertex_buffers[0] = gfx.display.vbuf,
-        .fs_images[SLOT_tex] = gfx.upscale.img,
-    });
+    if (gfx.display.single_pass) {
+        gfx_draw_sharp();
+    }
+    else {
+        sg_apply_pipeline(gfx.display.pip);
+        sg_apply_bindings(&(sg_bindings){
+            .vertex_buffers[0] = gfx.display.vbuf,
+            .fs_images[SLOT_tex] = gfx.upscale.img,
+        });
+    }
     sg_draw(0, 4, 1);
     sg_apply_viewport(0, 0, w, h, true);
     sdtx_draw();
@@ -488,10 +1049,24 @@ void gfx_draw(int emu_width, int emu_height) {
     }
     sg_end_pass();
     sg_commit();
+    prof_end();
 }
 
 void gfx_shutdown() {
     assert(gfx.valid);
+    for (int tile = 0; tile < gfx.tiles.num; tile++) {
+        for (int i = 0; i < 3; i++) {
+            free(gfx.tribuf[tile].buffers[i]);
+            gfx.tribuf[tile].buffers[i] = 0;
+        }
+    }
+    free(gfx.dirty.shadow);
+    gfx.dirty.shadow = 0;
+    free(gfx.indexed.pixels);
+    gfx.indexed.pixels = 0;
+    free(gfx.fb.alloc);
+    gfx.fb.alloc = 0;
+    gfx.fb.ptr = 0;
     sgl_shutdown();
     sdtx_shutdown();
     sg_shutdown();
@@ -7,10 +7,21 @@
     ${wait:20} - wait 20 frames before continuing
 */
 
+#define KEYBUF_MAX_KEYS (64 * 1024)
+
 typedef struct {
     int key_delay_frames;
 } keybuf_desc_t;
 
+/* a keybuf instance, only needed when running several emulators side by side */
+typedef struct {
+    bool valid;
+    int cur_pos;
+    int cur_delay_time;
+    int key_delay_time;
+    uint8_t buf[KEYBUF_MAX_KEYS];
+} keybuf_t;
+
 /* initialize the keybuf with a base-delay between keys in 60 Hz frames */
 void keybuf_init(const keybuf_desc_t* desc);
 /* put a text for playback into keybuf */
@@ -18,6 +29,11 @@ void keybuf_put(const char* text);
 /* get next key to feed into emulator, call once per frame, returns 0 if no key to feed */
 uint8_t keybuf_get(uint32_t frame_time_us);
 
+/* same as above, but on a caller-owned keybuf instance */
+void keybuf_instance_init(keybuf_t* kb, const keybuf_desc_t* desc);
+void keybuf_instance_put(keybuf_t* kb, const char* text);
+uint8_t keybuf_instance_get(keybuf_t* kb, uint32_t frame_time_us);
+
 /*== IMPLEMENTATION ==========================================================*/
 #ifdef COMMON_IMPL
 #include <stdint.h>
@@ -25,59 +41,53 @@ uint8_t keybuf_get(uint32_t frame_time_us);
 #include <stdlib.h>
 #include <assert.h>
 
-#define KEYBUF_MAX_KEYS (64 * 1024)
-typedef struct {
-    bool valid;
-    int cur_pos;
-    int cur_delay_time;
-    int key_delay_time;
-    uint8_t buf[KEYBUF_MAX_KEYS];
-} keybuf_state_t;
-static keybuf_state_t keybuf;
+static keybuf_t keybuf;
 
-void keybuf_init(const keybuf_desc_t* desc) {
-    keybuf = (keybuf_state_t) {
-        .valid = true,
-        .key_delay_time = desc->key_delay_frames * 16667,
-    };
+void keybuf_instance_init(keybuf_t* kb, const keybuf_desc_t* desc) {
+    assert(kb && desc);
+    kb->valid = true;
+    kb->cur_pos = 0;
+    kb->cur_delay_time = 0;
+    kb->key_delay_time = desc->key_delay_frames * 16667;
+    kb->buf[0] = 0;
 }
 
-void keybuf_put(const char* text) {
-    assert(keybuf.valid);
+void keybuf_instance_put(keybuf_t* kb, const char* text) {
+    assert(kb && kb->valid);
     if (!text) {
         return;
     }
-    keybuf.cur_delay_time = 0;
+    kb->cur_delay_time = 0;
     int len = (int) strlen(text);
     if ((len+1) < KEYBUF_MAX_KEYS) {
-        strcpy((char*)keybuf.buf, text);
+        strcpy((char*)kb->buf, text);
     }
     else {
-        keybuf.buf[0] = 0;
+        kb->buf[0] = 0;
     }
-    keybuf.cur_pos = 0;
+    kb->cur_pos = 0;
 }
 
-static uint8_t _keybuf_peek(void) {
-    if (keybuf.cur_pos < KEYBUF_MAX_KEYS) {
-        return keybuf.buf[keybuf.cur_pos];
+static uint8_t _keybuf_peek(keybuf_t* kb) {
+    if (kb->cur_pos < KEYBUF_MAX_KEYS) {
+        return kb->buf[kb->cur_pos];
     }
     else {
         return 0;
     }
 }
 
-static uint8_t _keybuf_next(void) {
-    uint8_t c = _keybuf_peek();
+static uint8_t _keybuf_next(keybuf_t* kb) {
+    uint8_t c = _keybuf_peek(kb);
     if (0 != c) {
-        keybuf.cur_pos++;
+        kb->cur_pos++;
     }
     return c;
 }
 
-static bool _keybuf_extract(uint8_t delim, uint8_t* buf, int buf_size) {
+static bool _keybuf_extract(keybuf_t* kb, uint8_t delim, uint8_t* buf, int buf_size) {
     for (int i = 0; i < buf_size; i++) {
-        buf[i] = _keybuf_next();
+        buf[i] = _keybuf_next(kb);
         if (buf[i] == delim) {
             buf[i] = 0;
             return true;
@@ -87,19 +97,19 @@ static bool _keybuf_extract(uint8_t delim, uint8_t* buf, int buf_size) {
     return false;
 }
 
-static uint8_t _keybuf_parse_cmd(void) {
+static uint8_t _keybuf_parse_cmd(keybuf_t* kb) {
     /* skip initial '{' */
-    _keybuf_next();
+    _keybuf_next(kb);
     uint8_t key[8];
     uint8_t val[8];
-    if (_keybuf_extract(':', key, sizeof(key))) {
-        if (_keybuf_extract('}', val, sizeof(val))) {
+    if (_keybuf_extract(kb, ':', key, sizeof(key))) {
+        if (_keybuf_extract(kb, '}', val, sizeof(val))) {
             if (strcmp((const char*)key, "wait") == 0) {
-                keybuf.cur_delay_time = atoi((const char*)val) * 16667;
+                kb->cur_delay_time = atoi((const char*)val) * 16667;
                 return 0;
             }
             else if (strcmp((const char*)key, "delay") == 0) {
-                keybuf.key_delay_time = atoi((const char*)val) * 16667;
+                kb->key_delay_time = atoi((const char*)val) * 16667;
                 return 0;
             }
             else if (strcmp((const char*)key, "key") == 0) {
@@ -111,16 +121,16 @@ static uint8_t _keybuf_parse_cmd(void) {
     return 0;
 }
 
-uint8_t keybuf_get(uint32_t frame_time_us) {
-    assert(keybuf.valid);
+uint8_t keybuf_instance_get(keybuf_t* kb, uint32_t frame_time_us) {
+    assert(kb && kb->valid);
     uint8_t c = 0;
-    if (keybuf.cur_delay_time <= 0) {
-        keybuf.cur_delay_time = keybuf.key_delay_time;
-        c = _keybuf_next();
+    if (kb->cur_delay_time <= 0) {
+        kb->cur_delay_time = kb->key_delay_time;
+        c = _keybuf_next(kb);
         if (c != 0) {
             /* check for special ${:} command */
-            if (((c == '$') || (c == '#')) && (_keybuf_peek() == '{')) {
-                c = _keybuf_parse_cmd();
+            if (((c == '$') || (c == '#')) && (_keybuf_peek(kb) == '{')) {
+                c = _keybuf_parse_cmd(kb);
             }
             /* replace /n with 0x0D */
             if (c == 0x0A) {
@@ -129,8 +139,20 @@ uint8_t keybuf_get(uint32_t frame_time_us) {
         }
     }
     else {
-        keybuf.cur_delay_time -= (int) frame_time_us;
+        kb->cur_delay_time -= (int) frame_time_us;
     }
     return c;
 }
+
+void keybuf_init(const keybuf_desc_t* desc) {
+    keybuf_instance_init(&keybuf, desc);
+}
+
+void keybuf_put(const char* text) {
+    keybuf_instance_put(&keybuf, text);
+}
+
+uint8_t keybuf_get(uint32_t frame_time_us) {
+    return keybuf_instance_get(&keybuf, frame_time_us);
+}
 #endif /* COMMON_IMPL */
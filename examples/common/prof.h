@@ -1,9 +1,56 @@
+#pragma once
 /*
     A simple profiling helper module.
+
+    Fixed buckets (prof_push) collect values which are measured elsewhere.
+
+    Statistics are kept in a log-linear histogram (16 linear steps per
+    power of two, in microseconds, so percentiles are off by at most ~6%)
+    which is updated on each pushed value. Reading min/avg/max and the
+    p50/p95/p99 percentiles doesn't depend on the number of values, and
+    prof_reset() starts a new reporting window.
+
+    Named zones measure the time between prof_begin() and prof_end(), they
+    are registered on their first call and can be nested:
+
+        prof_begin("emu_exec");
+        prof_begin("run_ahead");
+        ...
+        prof_end();
+        prof_end();
+
+    Each zone records the inclusive time (with nested zones) and the self
+    time (without nested zones) in the same kind of histograms, and counts
+    its calls. prof_reset_zones() starts a new reporting window for all
+    zones, each zone is cleared by its own thread on its next prof_end().
+
+    prof_trace_start() additionally records the start and end time of each
+    zone call into a preallocated ring buffer per thread (so the most recent
+    calls are kept), and prof_trace_write() writes them as Chrome trace-event
+    JSON which can be opened in chrome://tracing or ui.perfetto.dev.
+    Recording an event only stores the already measured times, recording
+    pauses while prof_trace_write() runs, and each event carries a sequence
+    number, so that an event which is rewritten while it is written to the
+    file (by a call which passed the pause check just before) is skipped.
+    Nesting is tracked per thread, so zones can also be used on the emulator
+    thread, but one zone should only be used on one thread. The histograms
+    of a zone are updated by its own thread without synchronization, so
+    prof_zone_stats() on another thread must be kept apart from that
+    thread's prof_end() calls, e.g. by the lock which the other thread
+    holds around its zones. Zone names must be string literals (or
+    otherwise outlive the profiler).
 */
+#include <stdint.h>
+#include <stdbool.h>
+
+#define PROF_MAX_ZONES (64)
+#define PROF_MAX_DEPTH (16)
+#define PROF_MAX_TRACE_THREADS (8)
+
 typedef enum {
     PROF_FRAME,     // frame time
     PROF_EMU,       // emulator time
+    PROF_UPLOAD,    // framebuffer texture upload time
     PROF_NUM_BUCKET_TYPES,
 } prof_bucket_type_t;
 
@@ -12,8 +59,20 @@ typedef struct {
     float avg_val;
     float min_val;
     float max_val;
+    float p50_val;
+    float p95_val;
+    float p99_val;
 } prof_stats_t;
 
+typedef struct {
+    const char* name;
+    int parent;             // zone which enclosed the first call, -1 for a top-level zone
+    int depth;              // nesting depth of the first call
+    uint64_t calls;         // number of calls since prof_init()
+    prof_stats_t incl;      // inclusive time in the reporting window in milliseconds
+    prof_stats_t self;      // self time in the reporting window in milliseconds
+} prof_zone_stats_t;
+
 // initialize profiling system
 void prof_init(void);
 // push a value into a profiler bucket
@@ -22,15 +81,51 @@ void prof_push(prof_bucket_type_t type, float val);
 int prof_count(prof_bucket_type_t type);
 // get a value from profiler bucket
 float prof_value(prof_bucket_type_t type, int index);
-// get average value in bucket
+// get min/avg/max and percentiles of the values pushed since the last prof_reset()
 prof_stats_t prof_stats(prof_bucket_type_t type);
+// start a new reporting window for a bucket
+void prof_reset(prof_bucket_type_t type);
+// begin a named zone on the calling thread
+void prof_begin(const char* name);
+// end the innermost zone on the calling thread
+void prof_end(void);
+// get the number of registered zones
+int prof_num_zones(void);
+// get the statistics of a zone (0 .. prof_num_zones()-1, in registration order), see above for threads
+prof_zone_stats_t prof_zone_stats(int zone);
+// start a new reporting window for all zones
+void prof_reset_zones(void);
+// start recording zone calls, max_events per thread (rounded up to a power of two)
+void prof_trace_start(int max_events);
+// return true if zone calls are recorded
+bool prof_trace_enabled(void);
+// set the name of the calling thread in the trace (must outlive the profiler)
+void prof_trace_thread_name(const char* name);
+// write the recorded zone calls as Chrome trace-event JSON file
+bool prof_trace_write(const char* path);
 
 /*== IMPLEMENTATION ==========================================================*/
 #ifdef COMMON_IMPL
 #include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include "sokol_time.h"
+#include "thread.h"
 
 #define PROF_BUCKET_SIZE (128)
+// log-linear histogram: values below 16us get one bin each, above that
+// each power of two is split into 16 bins
+#define PROF_HIST_SUB_BITS (4)
+#define PROF_HIST_SUB_COUNT (1<<PROF_HIST_SUB_BITS)
+#define PROF_HIST_NUM_GROUPS (32 - PROF_HIST_SUB_BITS + 1)
+#define PROF_HIST_NUM_BINS (PROF_HIST_NUM_GROUPS * PROF_HIST_SUB_COUNT)
+
+#if defined(_MSC_VER)
+#define _PROF_THREAD_LOCAL __declspec(thread)
+#else
+#define _PROF_THREAD_LOCAL __thread
+#endif
 
 // a simple ring buffer struct
 typedef struct {
@@ -39,15 +134,73 @@ typedef struct {
     float values[PROF_BUCKET_SIZE];
 } prof_ring_t;
 
+typedef struct {
+    uint32_t count;
+    double sum;
+    float min_val;
+    float max_val;
+    uint32_t groups[PROF_HIST_NUM_GROUPS];  // number of values per power of two
+    uint32_t bins[PROF_HIST_NUM_BINS];
+} prof_hist_t;
+
 typedef struct {
     prof_ring_t ring;
+    prof_hist_t hist;
 } prof_bucket_t;
 
+typedef struct {
+    const char* name;
+    int parent;
+    int depth;
+    uint64_t calls;
+    int window;             // reporting window the histograms belong to
+    prof_hist_t incl;
+    prof_hist_t self;
+} prof_zone_t;
+
+// the open zones of one thread
+typedef struct {
+    int depth;
+    int zones[PROF_MAX_DEPTH];
+    uint64_t start[PROF_MAX_DEPTH];
+    uint64_t child[PROF_MAX_DEPTH];     // accumulated inclusive time of nested zones
+} prof_zone_stack_t;
+
+typedef struct {
+    volatile int seq;       // event index + 1 once recorded, 0 while the event is written
+    uint64_t start;
+    uint64_t end;
+    int zone;
+} prof_trace_event_t;
+
+// the trace ring buffer of one thread, only written by its own thread
+typedef struct {
+    const char* name;
+    volatile int head;                  // number of recorded events
+    prof_trace_event_t* events;
+} prof_trace_buffer_t;
+
 static struct {
     bool valid;
     prof_bucket_t buckets[PROF_NUM_BUCKET_TYPES];
+    thread_mutex_t zone_lock;           // only taken to register a new zone
+    volatile int num_zones;
+    volatile int zone_window;           // bumped by prof_reset_zones()
+    prof_zone_t zones[PROF_MAX_ZONES];
+    struct {
+        int mask;                       // max events per thread - 1, 0 if not recording
+        volatile int paused;            // set while the trace is written
+        uint64_t start;
+        volatile int num_buffers;
+        prof_trace_buffer_t buffers[PROF_MAX_TRACE_THREADS];
+        prof_trace_event_t* events;     // one allocation for all buffers
+    } trace;
 } prof;
 
+static _PROF_THREAD_LOCAL prof_zone_stack_t prof_zone_stack;
+static _PROF_THREAD_LOCAL prof_trace_buffer_t* prof_trace_buffer;
+static _PROF_THREAD_LOCAL const char* prof_trace_name;
+
 static int prof_ring_idx(int i) {
     return (i % PROF_BUCKET_SIZE);
 }
@@ -69,14 +222,190 @@ static void prof_ring_put(prof_ring_t* ring, float value) {
     }
 }
 
-static float prof_ring_get(prof_ring_t* ring, int index) {
+static float prof_ring_get(const prof_ring_t* ring, int index) {
     return ring->values[prof_ring_idx(ring->tail + index)];
 }
 
+static int prof_hist_bin(float val) {
+    const float us = val * 1000.0f + 0.5f;
+    const uint32_t v = (us <= 0.0f) ? 0 : ((us >= 4294967295.0f) ? 0xFFFFFFFF : (uint32_t)us);
+    if (v < PROF_HIST_SUB_COUNT) {
+        return (int)v;
+    }
+    int msb = PROF_HIST_SUB_BITS;
+    while ((msb < 31) && (v >> (msb + 1))) {
+        msb++;
+    }
+    const int shift = msb - PROF_HIST_SUB_BITS;
+    return ((shift + 1) << PROF_HIST_SUB_BITS) + (int)((v >> shift) & (PROF_HIST_SUB_COUNT - 1));
+}
+
+// center of a histogram bin in milliseconds
+static float prof_hist_bin_value(int bin) {
+    if (bin < PROF_HIST_SUB_COUNT) {
+        return (float)bin * 0.001f;
+    }
+    const int shift = (bin >> PROF_HIST_SUB_BITS) - 1;
+    const int sub = bin & (PROF_HIST_SUB_COUNT - 1);
+    const double lower = (double)((uint64_t)(PROF_HIST_SUB_COUNT + sub) << shift);
+    const double width = (double)((uint64_t)1 << shift);
+    return (float)((lower + (width - 1.0) * 0.5) * 0.001);
+}
+
+static void prof_hist_reset(prof_hist_t* hist) {
+    memset(hist, 0, sizeof(prof_hist_t));
+}
+
+static void prof_hist_put(prof_hist_t* hist, float val) {
+    if (0 == hist->count) {
+        hist->min_val = val;
+        hist->max_val = val;
+    }
+    else if (val < hist->min_val) {
+        hist->min_val = val;
+    }
+    else if (val > hist->max_val) {
+        hist->max_val = val;
+    }
+    hist->count++;
+    hist->sum += val;
+    const int bin = prof_hist_bin(val);
+    hist->groups[bin >> PROF_HIST_SUB_BITS]++;
+    hist->bins[bin]++;
+}
+
+/* value below which 'rank' values are, first skips whole powers of two,
+   then the bins of the matching power of two
+*/
+static float prof_hist_value_at(const prof_hist_t* hist, uint32_t rank) {
+    uint32_t accum = 0;
+    int group = 0;
+    while ((group < (PROF_HIST_NUM_GROUPS - 1)) && ((accum + hist->groups[group]) < rank)) {
+        accum += hist->groups[group++];
+    }
+    int bin = group << PROF_HIST_SUB_BITS;
+    const int last_bin = bin + PROF_HIST_SUB_COUNT - 1;
+    while ((bin < last_bin) && ((accum + hist->bins[bin]) < rank)) {
+        accum += hist->bins[bin++];
+    }
+    // the exact extremes are known, don't report a bin center beyond them
+    float val = prof_hist_bin_value(bin);
+    if (val < hist->min_val) {
+        val = hist->min_val;
+    }
+    if (val > hist->max_val) {
+        val = hist->max_val;
+    }
+    return val;
+}
+
+static uint32_t prof_hist_rank(uint32_t count, uint32_t percent) {
+    const uint32_t rank = (uint32_t)(((uint64_t)count * percent + 99) / 100);
+    return (rank > 0) ? rank : 1;
+}
+
+static prof_stats_t prof_hist_stats(const prof_hist_t* hist) {
+    prof_stats_t stats = {0};
+    if (hist->count > 0) {
+        stats.count = (int)hist->count;
+        stats.avg_val = (float)(hist->sum / (double)hist->count);
+        stats.min_val = hist->min_val;
+        stats.max_val = hist->max_val;
+        stats.p50_val = prof_hist_value_at(hist, prof_hist_rank(hist->count, 50));
+        stats.p95_val = prof_hist_value_at(hist, prof_hist_rank(hist->count, 95));
+        stats.p99_val = prof_hist_value_at(hist, prof_hist_rank(hist->count, 99));
+    }
+    return stats;
+}
+
+/* find a zone by name, or register it, returns -1 if all zone slots are
+   used, lookups don't lock since registered zones never change
+*/
+static int prof_find_zone(const char* name) {
+    int num_zones = thread_atomic_load(&prof.num_zones);
+    // names are usually the same string literal
+    for (int i = 0; i < num_zones; i++) {
+        if (prof.zones[i].name == name) {
+            return i;
+        }
+    }
+    for (int i = 0; i < num_zones; i++) {
+        if (0 == strcmp(prof.zones[i].name, name)) {
+            return i;
+        }
+    }
+    thread_mutex_lock(prof.zone_lock);
+    // another thread may have registered zones in the meantime
+    int zone = -1;
+    for (int i = num_zones; i < prof.num_zones; i++) {
+        if (0 == strcmp(prof.zones[i].name, name)) {
+            zone = i;
+            break;
+        }
+    }
+    if ((zone < 0) && (prof.num_zones < PROF_MAX_ZONES)) {
+        zone = prof.num_zones;
+        prof_zone_t* z = &prof.zones[zone];
+        z->name = name;
+        z->depth = prof_zone_stack.depth;
+        z->parent = (z->depth > 0) ? prof_zone_stack.zones[z->depth - 1] : -1;
+        thread_atomic_store(&prof.num_zones, zone + 1);
+    }
+    thread_mutex_unlock(prof.zone_lock);
+    return zone;
+}
+
+/* claim a trace buffer for the calling thread, returns 0 if all buffers
+   are used by other threads
+*/
+static prof_trace_buffer_t* prof_trace_claim_buffer(void) {
+    const int index = thread_atomic_add(&prof.trace.num_buffers, 1);
+    if (index >= PROF_MAX_TRACE_THREADS) {
+        return 0;
+    }
+    prof_trace_buffer_t* buf = &prof.trace.buffers[index];
+    buf->name = prof_trace_name;
+    buf->events = prof.trace.events + (size_t)index * (size_t)(prof.trace.mask + 1);
+    return buf;
+}
+
+static void prof_trace_record(int zone, uint64_t start, uint64_t end) {
+    prof_trace_buffer_t* buf = prof_trace_buffer;
+    if (0 == buf) {
+        buf = prof_trace_buffer = prof_trace_claim_buffer();
+        if (0 == buf) {
+            return;
+        }
+    }
+    const int head = buf->head;
+    prof_trace_event_t* ev = &buf->events[head & prof.trace.mask];
+    // mark the slot as being written before its data changes (see prof_trace_write())
+    thread_atomic_exchange(&ev->seq, 0);
+    ev->start = start;
+    ev->end = end;
+    ev->zone = zone;
+    thread_atomic_store(&ev->seq, head + 1);
+    thread_atomic_store(&buf->head, head + 1);
+}
+
+static void prof_trace_write_string(FILE* fp, const char* str) {
+    fputc('"', fp);
+    for (; *str; str++) {
+        if ((*str == '"') || (*str == '\\')) {
+            fputc('\\', fp);
+        }
+        if ((unsigned char)*str >= 0x20) {
+            fputc(*str, fp);
+        }
+    }
+    fputc('"', fp);
+}
+
 // public API functions
 void prof_init(void) {
     stm_setup();
     memset(&prof, 0, sizeof(prof));
+    prof.zone_lock = thread_mutex_create();
     prof.valid = true;
 }
 
@@ -84,6 +413,7 @@ void prof_push(prof_bucket_type_t type, float val) {
     assert(prof.valid);
     assert((type >= 0) && (type < PROF_NUM_BUCKET_TYPES));
     prof_ring_put(&prof.buckets[type].ring, val);
+    prof_hist_put(&prof.buckets[type].hist, val);
 }
 
 int prof_count(prof_bucket_type_t type) {
@@ -101,23 +431,166 @@ float prof_value(prof_bucket_type_t type, int index) {
 prof_stats_t prof_stats(prof_bucket_type_t type) {
     assert(prof.valid);
     assert((type >= 0) && (type < PROF_NUM_BUCKET_TYPES));
-    prof_stats_t stats = {0};
-    prof_ring_t* ring = &prof.buckets[type].ring;
-    stats.count = prof_ring_count(ring);
-    if (stats.count > 0) {
-        stats.min_val = 1000.0f;
-        for (int i = 0; i < stats.count; i++) {
-            float val = prof_ring_get(ring, i);
-            stats.avg_val += val;
-            if (val < stats.min_val) {
-                stats.min_val = val;
+    return prof_hist_stats(&prof.buckets[type].hist);
+}
+
+void prof_reset(prof_bucket_type_t type) {
+    assert(prof.valid);
+    assert((type >= 0) && (type < PROF_NUM_BUCKET_TYPES));
+    prof_hist_reset(&prof.buckets[type].hist);
+}
+
+void prof_begin(const char* name) {
+    assert(prof.valid && name);
+    prof_zone_stack_t* stack = &prof_zone_stack;
+    const int depth = stack->depth++;
+    if (depth >= PROF_MAX_DEPTH) {
+        // too deeply nested, only keep track of the depth
+        return;
+    }
+    stack->zones[depth] = prof_find_zone(name);
+    stack->child[depth] = 0;
+    stack->start[depth] = stm_now();
+}
+
+void prof_end(void) {
+    assert(prof.valid);
+    prof_zone_stack_t* stack = &prof_zone_stack;
+    assert(stack->depth > 0);
+    const int depth = --stack->depth;
+    if (depth >= PROF_MAX_DEPTH) {
+        return;
+    }
+    const uint64_t end = stm_now();
+    const uint64_t incl_ticks = stm_diff(end, stack->start[depth]);
+    const uint64_t self_ticks = (incl_ticks > stack->child[depth]) ? (incl_ticks - stack->child[depth]) : 0;
+    if (depth > 0) {
+        stack->child[depth - 1] += incl_ticks;
+    }
+    const int zone = stack->zones[depth];
+    if (zone >= 0) {
+        prof_zone_t* z = &prof.zones[zone];
+        z->calls++;
+        const int window = thread_atomic_load(&prof.zone_window);
+        if (z->window != window) {
+            z->window = window;
+            prof_hist_reset(&z->incl);
+            prof_hist_reset(&z->self);
+        }
+        prof_hist_put(&z->incl, (float)stm_ms(incl_ticks));
+        prof_hist_put(&z->self, (float)stm_ms(self_ticks));
+        if (prof.trace.mask && (0 == thread_atomic_load(&prof.trace.paused))) {
+            prof_trace_record(zone, stack->start[depth], end);
+        }
+    }
+}
+
+int prof_num_zones(void) {
+    assert(prof.valid);
+    return thread_atomic_load(&prof.num_zones);
+}
+
+prof_zone_stats_t prof_zone_stats(int zone) {
+    assert(prof.valid);
+    assert((zone >= 0) && (zone < prof_num_zones()));
+    const prof_zone_t* z = &prof.zones[zone];
+    prof_zone_stats_t res = {
+        .name = z->name,
+        .parent = z->parent,
+        .depth = z->depth,
+        .calls = z->calls,
+    };
+    // a zone that wasn't called since the last prof_reset_zones() still
+    // holds the histograms of an older window
+    if (z->window == thread_atomic_load(&prof.zone_window)) {
+        res.incl = prof_hist_stats(&z->incl);
+        res.self = prof_hist_stats(&z->self);
+    }
+    return res;
+}
+
+void prof_reset_zones(void) {
+    assert(prof.valid);
+    thread_atomic_add(&prof.zone_window, 1);
+}
+void prof_trace_start(int max_events) {
+    assert(prof.valid && (0 == prof.trace.mask) && (max_events > 0));
+    int num_events = 1;
+    while (num_events < max_events) {
+        num_events <<= 1;
+    }
+    prof.trace.events = (prof_trace_event_t*) calloc((size_t)num_events * PROF_MAX_TRACE_THREADS, sizeof(prof_trace_event_t));
+    assert(prof.trace.events);
+    prof.trace.start = stm_now();
+    prof.trace.mask = num_events - 1;
+}
+
+bool prof_trace_enabled(void) {
+    return 0 != prof.trace.mask;
+}
+
+void prof_trace_thread_name(const char* name) {
+    prof_trace_name = name;
+    if (prof_trace_buffer) {
+        prof_trace_buffer->name = name;
+    }
+}
+
+bool prof_trace_write(const char* path) {
+    assert(prof.valid && path);
+    if (0 == prof.trace.mask) {
+        return false;
+    }
+    FILE* fp = fopen(path, "w");
+    if (!fp) {
+        return false;
+    }
+    thread_atomic_store(&prof.trace.paused, 1);
+    fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    fprintf(fp, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"chips\"}}");
+    int num_buffers = thread_atomic_load(&prof.trace.num_buffers);
+    if (num_buffers > PROF_MAX_TRACE_THREADS) {
+        num_buffers = PROF_MAX_TRACE_THREADS;
+    }
+    for (int tid = 0; tid < num_buffers; tid++) {
+        prof_trace_buffer_t* buf = &prof.trace.buffers[tid];
+        if (buf->name) {
+            fprintf(fp, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":", tid);
+            prof_trace_write_string(fp, buf->name);
+            fprintf(fp, "}}");
+        }
+        // the oldest events have been overwritten if the ring buffer wrapped around
+        const int head = thread_atomic_load((volatile int*)&buf->head);
+        const int first = (head > (prof.trace.mask + 1)) ? (head - (prof.trace.mask + 1)) : 0;
+        for (int i = first; i < head; i++) {
+            /* a zone call which passed the pause check before it was set may
+               still record an event into the oldest slot, so copy the event
+               and only keep it if its sequence number didn't change meanwhile
+               (the read-modify-write keeps the copy before the second check)
+            */
+            prof_trace_event_t* slot = &buf->events[i & prof.trace.mask];
+            if (thread_atomic_load(&slot->seq) != (i + 1)) {
+                continue;
+            }
+            const uint64_t start = slot->start;
+            const uint64_t end = slot->end;
+            const int zone = slot->zone;
+            if (thread_atomic_add(&slot->seq, 0) != (i + 1)) {
+                continue;
             }
-            if (val > stats.max_val) {
-                stats.max_val = val;
+            if ((zone < 0) || (start < prof.trace.start)) {
+                continue;
             }
+            fprintf(fp, ",\n{\"name\":");
+            prof_trace_write_string(fp, prof.zones[zone].name);
+            fprintf(fp, ",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+                tid,
+                stm_us(stm_diff(start, prof.trace.start)),
+                stm_us(stm_diff(end, start)));
         }
-        stats.avg_val /= (float)stats.count;
     }
-    return stats;
+    fprintf(fp, "\n]}\n");
+    thread_atomic_store(&prof.trace.paused, 0);
+    return 0 == fclose(fp);
 }
 #endif // COMMON_IMPL
@@ -0,0 +1,330 @@
+#pragma once
+/*
+    Rewind buffer for emulator state snapshots.
+
+    Captures the emulator state (a plain memory blob) once per frame into a
+    fixed-size ring arena. Every keyframe_interval frames a full keyframe is
+    stored, the frames in between are stored as XOR deltas against the
+    previous frame, run-length encoded in 64-bit words (unchanged memory
+    compresses to nothing). Nothing is allocated per frame, when the arena
+    or frame limit is reached the oldest second of frames is dropped.
+
+    Since the deltas are XORs, stepping back one frame only needs the newest
+    delta applied to the current state, keyframes are only needed to rebuild
+    the state after popping a keyframe.
+*/
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct {
+    size_t state_size;          // size of the emulator state in bytes
+    size_t arena_size;          // size of the ring arena in bytes (default: 48 MB)
+    int max_frames;             // max number of frames to keep (default: 3600)
+    int keyframe_interval;      // store a keyframe every N frames (default: 60)
+} rewind_desc_t;
+
+typedef struct {
+    int num_frames;             // number of frames in the rewind buffer
+    int num_keyframes;          // number of keyframes in the rewind buffer
+    size_t arena_size;          // size of the arena in bytes
+    size_t arena_used;          // bytes of the arena used by frames
+    double capture_time_ms;     // host time of the last capture
+} rewind_stats_t;
+
+/* setup the rewind buffer, allocates the arena */
+void rewind_init(const rewind_desc_t* desc);
+/* free the arena */
+void rewind_shutdown(void);
+/* true if rewind_init() has been called */
+bool rewind_isvalid(void);
+/* drop all captured frames (e.g. after loading a snapshot) */
+void rewind_reset(void);
+/* capture an emulator state, call once per frame */
+void rewind_capture(const void* state);
+/* copy the newest captured state to 'state' and drop it, returns false if empty */
+bool rewind_pop(void* state);
+/* get memory and timing statistics */
+rewind_stats_t rewind_stats(void);
+
+/*== IMPLEMENTATION ==========================================================*/
+#ifdef COMMON_IMPL
+#include "sokol_time.h"
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#define _REWIND_DEFAULT_ARENA_SIZE (48 * 1024 * 1024)
+#define _REWIND_DEFAULT_MAX_FRAMES (3600)
+#define _REWIND_DEFAULT_KEYFRAME_INTERVAL (60)
+#define _REWIND_DEF(v,def) (v?v:def)
+
+typedef struct {
+    size_t offset;
+    size_t size;
+    bool keyframe;
+} _rewind_entry_t;
+
+typedef struct {
+    bool valid;
+    size_t state_size;
+    size_t num_words;           // state size in 64-bit words (rounded up)
+    int max_frames;
+    int keyframe_interval;
+    int first;                  // index of oldest entry
+    int num;                    // number of entries
+    int num_keyframes;
+    int frames_since_keyframe;
+    size_t write_pos;           // next arena offset to allocate from
+    size_t arena_size;
+    size_t arena_used;
+    double capture_time_ms;
+    uint8_t* arena;
+    uint64_t* cur;              // state of the newest entry
+    uint8_t* scratch;           // encode buffer, worst case size
+    _rewind_entry_t* entries;
+} rewind_state_t;
+static rewind_state_t rwnd;
+
+static inline uint64_t _rewind_load(const uint8_t* ptr, size_t word_index, size_t state_size) {
+    uint64_t w = 0;
+    const size_t offset = word_index * 8;
+    memcpy(&w, ptr + offset, ((offset + 8) <= state_size) ? 8 : (state_size - offset));
+    return w;
+}
+
+static int _rewind_index(int i) {
+    return (rwnd.first + i) % rwnd.max_frames;
+}
+
+static void _rewind_drop_oldest(void) {
+    assert(rwnd.num > 0);
+    _rewind_entry_t* e = &rwnd.entries[rwnd.first];
+    rwnd.arena_used -= e->size;
+    if (e->keyframe) {
+        rwnd.num_keyframes--;
+    }
+    rwnd.first = (rwnd.first + 1) % rwnd.max_frames;
+    rwnd.num--;
+}
+
+// drop the oldest keyframe and all deltas depending on it
+static void _rewind_drop_oldest_group(void) {
+    _rewind_drop_oldest();
+    while ((rwnd.num > 0) && !rwnd.entries[rwnd.first].keyframe) {
+        _rewind_drop_oldest();
+    }
+    if (rwnd.num == 0) {
+        rwnd.write_pos = 0;
+        rwnd.frames_since_keyframe = 0;
+    }
+}
+
+// find space for a new entry in the ring arena, dropping old frames if needed
+static size_t _rewind_alloc(size_t size) {
+    assert(size <= rwnd.arena_size);
+    if (rwnd.num == rwnd.max_frames) {
+        _rewind_drop_oldest_group();
+    }
+    size_t pos = rwnd.write_pos;
+    if ((pos + size) > rwnd.arena_size) {
+        // wrap around: the frames behind the write position are the oldest
+        // ones from the previous lap, drop them before reusing the start
+        // of the arena (the overlap check below only looks at the oldest frame)
+        while ((rwnd.num > 0) && (rwnd.entries[rwnd.first].offset >= rwnd.write_pos)) {
+            _rewind_drop_oldest_group();
+        }
+        pos = 0;
+    }
+    while (rwnd.num > 0) {
+        const _rewind_entry_t* oldest = &rwnd.entries[rwnd.first];
+        const bool overlaps = (pos < (oldest->offset + oldest->size)) && (oldest->offset < (pos + size));
+        if (!overlaps) {
+            break;
+        }
+        _rewind_drop_oldest_group();
+    }
+    return pos;
+}
+
+// XOR the encoded delta into the current state
+static void _rewind_apply_delta(const uint8_t* src, size_t size) {
+    const uint8_t* end = src + size;
+    size_t word = 0;
+    while (src < end) {
+        uint32_t skip, count;
+        memcpy(&skip, src, 4);
+        memcpy(&count, src + 4, 4);
+        src += 8;
+        word += skip;
+        for (uint32_t i = 0; i < count; i++, word++, src += 8) {
+            uint64_t x;
+            memcpy(&x, src, 8);
+            rwnd.cur[word] ^= x;
+        }
+    }
+    assert(word <= rwnd.num_words);
+}
+
+void rewind_init(const rewind_desc_t* desc) {
+    assert(desc && (desc->state_size > 0));
+    memset(&rwnd, 0, sizeof(rwnd));
+    rwnd.state_size = desc->state_size;
+    rwnd.num_words = (desc->state_size + 7) / 8;
+    rwnd.arena_size = _REWIND_DEF(desc->arena_size, _REWIND_DEFAULT_ARENA_SIZE);
+    rwnd.max_frames = _REWIND_DEF(desc->max_frames, _REWIND_DEFAULT_MAX_FRAMES);
+    rwnd.keyframe_interval = _REWIND_DEF(desc->keyframe_interval, _REWIND_DEFAULT_KEYFRAME_INTERVAL);
+    rwnd.arena = (uint8_t*) malloc(rwnd.arena_size);
+    rwnd.cur = (uint64_t*) calloc(rwnd.num_words, sizeof(uint64_t));
+    // worst case: a (skip, count) header per word
+    rwnd.scratch = (uint8_t*) malloc(rwnd.num_words * 16);
+    rwnd.entries = (_rewind_entry_t*) calloc((size_t)rwnd.max_frames, sizeof(_rewind_entry_t));
+    assert(rwnd.arena && rwnd.cur && rwnd.scratch && rwnd.entries);
+    // a keyframe must always fit
+    assert(rwnd.arena_size >= rwnd.num_words * 8);
+    rwnd.valid = true;
+}
+
+void rewind_shutdown(void) {
+    assert(rwnd.valid);
+    free(rwnd.arena);
+    free(rwnd.cur);
+    free(rwnd.scratch);
+    free(rwnd.entries);
+    memset(&rwnd, 0, sizeof(rwnd));
+}
+
+bool rewind_isvalid(void) {
+    return rwnd.valid;
+}
+
+void rewind_reset(void) {
+    assert(rwnd.valid);
+    rwnd.first = 0;
+    rwnd.num = 0;
+    rwnd.num_keyframes = 0;
+    rwnd.frames_since_keyframe = 0;
+    rwnd.write_pos = 0;
+    rwnd.arena_used = 0;
+}
+
+void rewind_capture(const void* state) {
+    assert(rwnd.valid && state);
+    const uint64_t start_time = stm_now();
+    const uint8_t* src = (const uint8_t*) state;
+    bool keyframe = (rwnd.num == 0) || (rwnd.frames_since_keyframe >= rwnd.keyframe_interval);
+    size_t size = 0;
+    size_t pos = 0;
+    if (!keyframe) {
+        // XOR against the previous frame, and encode runs of changed words
+        uint8_t* dst = rwnd.scratch;
+        uint32_t skip = 0;
+        size_t word = 0;
+        while (word < rwnd.num_words) {
+            uint64_t w = _rewind_load(src, word, rwnd.state_size);
+            if (w == rwnd.cur[word]) {
+                skip++;
+                word++;
+                continue;
+            }
+            uint8_t* hdr = dst;
+            dst += 8;
+            uint32_t count = 0;
+            do {
+                const uint64_t x = w ^ rwnd.cur[word];
+                memcpy(dst, &x, 8);
+                dst += 8;
+                rwnd.cur[word] = w;
+                count++;
+                word++;
+                if (word < rwnd.num_words) {
+                    w = _rewind_load(src, word, rwnd.state_size);
+                }
+            } while ((word < rwnd.num_words) && (w != rwnd.cur[word]));
+            memcpy(hdr, &skip, 4);
+            memcpy(hdr + 4, &count, 4);
+            skip = 0;
+        }
+        size = (size_t)(dst - rwnd.scratch);
+        pos = _rewind_alloc(size);
+        if (rwnd.num == 0) {
+            // all previous frames had to be dropped, the delta has no base anymore
+            keyframe = true;
+        }
+        else {
+            memcpy(rwnd.arena + pos, rwnd.scratch, size);
+            rwnd.frames_since_keyframe++;
+        }
+    }
+    else {
+        memcpy(rwnd.cur, src, rwnd.state_size);
+    }
+    if (keyframe) {
+        size = rwnd.num_words * 8;
+        pos = _rewind_alloc(size);
+        memcpy(rwnd.arena + pos, rwnd.cur, size);
+        rwnd.frames_since_keyframe = 0;
+        rwnd.num_keyframes++;
+    }
+    rwnd.write_pos = pos;
+    _rewind_entry_t* e = &rwnd.entries[_rewind_index(rwnd.num)];
+    e->offset = rwnd.write_pos;
+    e->size = size;
+    e->keyframe = keyframe;
+    rwnd.num++;
+    rwnd.write_pos += size;
+    rwnd.arena_used += size;
+    rwnd.capture_time_ms = stm_ms(stm_since(start_time));
+}
+
+bool rewind_pop(void* state) {
+    assert(rwnd.valid && state);
+    if (rwnd.num == 0) {
+        return false;
+    }
+    memcpy(state, rwnd.cur, rwnd.state_size);
+    const _rewind_entry_t e = rwnd.entries[_rewind_index(rwnd.num - 1)];
+    rwnd.num--;
+    rwnd.arena_used -= e.size;
+    rwnd.write_pos = e.offset;
+    if (e.keyframe) {
+        rwnd.num_keyframes--;
+    }
+    if (rwnd.num == 0) {
+        rewind_reset();
+        return true;
+    }
+    if (!e.keyframe) {
+        // XOR deltas work in both directions
+        _rewind_apply_delta(rwnd.arena + e.offset, e.size);
+        rwnd.frames_since_keyframe--;
+    }
+    else {
+        // rebuild the new newest state from the previous keyframe
+        int key = rwnd.num - 1;
+        while (!rwnd.entries[_rewind_index(key)].keyframe) {
+            key--;
+        }
+        assert(key >= 0);
+        const _rewind_entry_t* k = &rwnd.entries[_rewind_index(key)];
+        memcpy(rwnd.cur, rwnd.arena + k->offset, k->size);
+        for (int i = key + 1; i < rwnd.num; i++) {
+            const _rewind_entry_t* d = &rwnd.entries[_rewind_index(i)];
+            _rewind_apply_delta(rwnd.arena + d->offset, d->size);
+        }
+        rwnd.frames_since_keyframe = rwnd.num - 1 - key;
+    }
+    return true;
+}
+
+rewind_stats_t rewind_stats(void) {
+    assert(rwnd.valid);
+    return (rewind_stats_t) {
+        .num_frames = rwnd.num,
+        .num_keyframes = rwnd.num_keyframes,
+        .arena_size = rwnd.arena_size,
+        .arena_used = rwnd.arena_used,
+        .capture_time_ms = rwnd.capture_time_ms,
+    };
+}
+#endif /* COMMON_IMPL */
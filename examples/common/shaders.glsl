@@ -17,6 +17,63 @@ void main() {
 }
 @end
 
+// same as upscale_fs, but the emulator framebuffer contains 8-bit palette
+// indices which are resolved through a 256x1 palette texture
+@fs upscale_indexed_fs
+uniform sampler2D idx_tex;
+uniform sampler2D pal_tex;
+in vec2 uv;
+out vec4 frag_color;
+void main() {
+    float idx = texture(idx_tex, uv).x * 255.0;
+    frag_color = texture(pal_tex, vec2((idx + 0.5) / 256.0, 0.5));
+}
+@end
+
+// decode the ZX Spectrum screen from raw video memory in a 256x28 R8
+// texture: rows 0..26 hold the 6144 bytes bitmap and 768 bytes attributes,
+// row 27 the border color of each display line
+@fs zxdecode_fs
+uniform zxdecode_params {
+    vec2 fb_size;       // size of the emulator display in pixels
+    vec2 screen_pos;    // top-left corner of the 256x192 screen area
+    float flash;        // 1.0 while flashing attributes are inverted
+};
+uniform sampler2D vram_tex;
+uniform sampler2D zxpal_tex;
+in vec2 uv;
+out vec4 frag_color;
+
+float vram_byte(float addr) {
+    float y = floor(addr / 256.0);
+    float x = addr - y * 256.0;
+    return floor(texture(vram_tex, vec2((x + 0.5) / 256.0, (y + 0.5) / 28.0)).x * 255.0 + 0.5);
+}
+
+float bits(float val, float shift, float range) {
+    return mod(floor(val / exp2(shift)), range);
+}
+
+void main() {
+    vec2 pos = floor(uv * fb_size);
+    vec2 sp = pos - screen_pos;
+    float color;
+    if ((sp.x < 0.0) || (sp.y < 0.0) || (sp.x >= 256.0) || (sp.y >= 192.0)) {
+        color = vram_byte(27.0 * 256.0 + pos.y);
+    }
+    else {
+        float col = floor(sp.x / 8.0);
+        float addr = bits(sp.y, 6.0, 4.0) * 2048.0 + bits(sp.y, 0.0, 8.0) * 256.0 + bits(sp.y, 3.0, 8.0) * 32.0 + col;
+        float pixels = vram_byte(addr);
+        float attr = vram_byte(6144.0 + floor(sp.y / 8.0) * 32.0 + col);
+        float pix = bits(pixels, 7.0 - mod(sp.x, 8.0), 2.0);
+        pix = abs(pix - flash * bits(attr, 7.0, 2.0));
+        color = mix(bits(attr, 3.0, 8.0), bits(attr, 0.0, 8.0), pix) + bits(attr, 6.0, 2.0) * 8.0;
+    }
+    frag_color = texture(zxpal_tex, vec2((color + 0.5) / 256.0, 0.5));
+}
+@end
+
 @vs display_vs
 layout(location=0) in vec2 in_pos;
 layout(location=1) in vec2 in_uv;
@@ -37,7 +94,62 @@ void main() {
 }
 @end
 
+// single-pass alternative to the upscale + display passes: sharp-bilinear
+// filtering (integer prescale followed by linear filtering) directly from
+// the emulator framebuffer texture, which must use linear filtering
+@fs display_sharp_fs
+uniform sharp_params {
+    vec2 tex_size;      // emulator framebuffer size in pixels
+    vec2 prescale;      // integer prescale factor, floor(viewport size / tex_size)
+};
+uniform sampler2D sharp_tex;
+in vec2 uv;
+out vec4 frag_color;
+void main() {
+    vec2 texel = uv * tex_size;
+    vec2 center_dist = fract(texel) - 0.5;
+    vec2 region_range = 0.5 - 0.5 / prescale;
+    vec2 f = (center_dist - clamp(center_dist, -region_range, region_range)) * prescale + 0.5;
+    frag_color = vec4(texture(sharp_tex, (floor(texel) + f) / tex_size).xyz, 1.0);
+}
+@end
+
+// same as display_sharp_fs for an 8-bit indexed framebuffer texture (with
+// nearest filtering), the palette is resolved before the bilinear filter
+@fs display_sharp_indexed_fs
+uniform sharp_indexed_params {
+    vec2 tex_size;
+    vec2 prescale;
+};
+uniform sampler2D sharp_idx_tex;
+uniform sampler2D sharp_pal_tex;
+in vec2 uv;
+out vec4 frag_color;
+
+vec3 texel_color(vec2 texel) {
+    float idx = texture(sharp_idx_tex, (texel + 0.5) / tex_size).x * 255.0;
+    return texture(sharp_pal_tex, vec2((idx + 0.5) / 256.0, 0.5)).xyz;
+}
+
+void main() {
+    vec2 texel = uv * tex_size;
+    vec2 center_dist = fract(texel) - 0.5;
+    vec2 region_range = 0.5 - 0.5 / prescale;
+    vec2 f = (center_dist - clamp(center_dist, -region_range, region_range)) * prescale + 0.5;
+    vec2 p = floor(texel) + f - 0.5;
+    vec2 i = floor(p);
+    vec2 w = p - i;
+    vec3 c0 = mix(texel_color(i), texel_color(i + vec2(1.0, 0.0)), w.x);
+    vec3 c1 = mix(texel_color(i + vec2(0.0, 1.0)), texel_color(i + vec2(1.0, 1.0)), w.x);
+    frag_color = vec4(mix(c0, c1, w.y), 1.0);
+}
+@end
+
 @program upscale upscale_vs upscale_fs
+@program upscale_indexed upscale_vs upscale_indexed_fs
+@program zxdecode upscale_vs zxdecode_fs
 @program display display_vs display_fs
+@program display_sharp display_vs display_sharp_fs
+@program display_sharp_indexed display_vs display_sharp_indexed_fs
 
 
@@ -0,0 +1,217 @@
+#pragma once
+/*
+    Minimal cross-platform threading helpers (pthreads or Win32) for
+    running emulator instances on worker threads.
+
+    The atomic helpers are inline functions in the declaration part so
+    that lock-free producer/consumer code doesn't pay for a function call.
+*/
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct {
+    void* handle;
+} thread_t;
+
+typedef struct {
+    void* handle;
+} thread_mutex_t;
+
+typedef void (*thread_func_t)(void* arg);
+
+/* start a new thread, returns a thread with null handle on failure */
+thread_t thread_start(thread_func_t func, void* arg);
+/* wait for a thread to finish and release its resources */
+void thread_join(thread_t thread);
+/* get the number of logical CPU cores */
+int thread_num_cores(void);
+/* put the calling thread to sleep for a number of microseconds */
+void thread_sleep_us(uint32_t us);
+/* create and destroy a mutex */
+thread_mutex_t thread_mutex_create(void);
+void thread_mutex_destroy(thread_mutex_t mutex);
+void thread_mutex_lock(thread_mutex_t mutex);
+void thread_mutex_unlock(thread_mutex_t mutex);
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+static inline int thread_atomic_load(volatile int* ptr) {
+    return _InterlockedOr((volatile long*)ptr, 0);
+}
+static inline void thread_atomic_store(volatile int* ptr, int val) {
+    _InterlockedExchange((volatile long*)ptr, val);
+}
+/* add a value and return the previous value */
+static inline int thread_atomic_add(volatile int* ptr, int val) {
+    return _InterlockedExchangeAdd((volatile long*)ptr, val);
+}
+/* store 'val' and return the previous value */
+static inline int thread_atomic_exchange(volatile int* ptr, int val) {
+    return _InterlockedExchange((volatile long*)ptr, val);
+}
+#else
+static inline int thread_atomic_load(volatile int* ptr) {
+    return __atomic_load_n(ptr, __ATOMIC_ACQUIRE);
+}
+static inline void thread_atomic_store(volatile int* ptr, int val) {
+    __atomic_store_n(ptr, val, __ATOMIC_RELEASE);
+}
+/* add a value and return the previous value */
+static inline int thread_atomic_add(volatile int* ptr, int val) {
+    return __atomic_fetch_add(ptr, val, __ATOMIC_ACQ_REL);
+}
+/* store 'val' and return the previous value */
+static inline int thread_atomic_exchange(volatile int* ptr, int val) {
+    return __atomic_exchange_n(ptr, val, __ATOMIC_ACQ_REL);
+}
+#endif
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+/*== IMPLEMENTATION ==========================================================*/
+#ifdef COMMON_IMPL
+#include <stdlib.h>
+#include <assert.h>
+#if defined(_WIN32)
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+#endif
+
+typedef struct {
+    thread_func_t func;
+    void* arg;
+} _thread_start_t;
+
+#if defined(_WIN32)
+static DWORD WINAPI _thread_entry(LPVOID ptr) {
+    _thread_start_t start = *(_thread_start_t*)ptr;
+    free(ptr);
+    start.func(start.arg);
+    return 0;
+}
+
+thread_t thread_start(thread_func_t func, void* arg) {
+    assert(func);
+    _thread_start_t* start = (_thread_start_t*) malloc(sizeof(_thread_start_t));
+    start->func = func;
+    start->arg = arg;
+    HANDLE handle = CreateThread(NULL, 0, _thread_entry, start, 0, NULL);
+    if (!handle) {
+        free(start);
+    }
+    return (thread_t){ .handle = (void*)handle };
+}
+
+void thread_join(thread_t thread) {
+    if (thread.handle) {
+        WaitForSingleObject((HANDLE)thread.handle, INFINITE);
+        CloseHandle((HANDLE)thread.handle);
+    }
+}
+
+int thread_num_cores(void) {
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return (int)info.dwNumberOfProcessors;
+}
+
+void thread_sleep_us(uint32_t us) {
+    Sleep((us + 999) / 1000);
+}
+
+thread_mutex_t thread_mutex_create(void) {
+    CRITICAL_SECTION* cs = (CRITICAL_SECTION*) malloc(sizeof(CRITICAL_SECTION));
+    InitializeCriticalSection(cs);
+    return (thread_mutex_t){ .handle = cs };
+}
+
+void thread_mutex_destroy(thread_mutex_t mutex) {
+    if (mutex.handle) {
+        DeleteCriticalSection((CRITICAL_SECTION*)mutex.handle);
+        free(mutex.handle);
+    }
+}
+
+void thread_mutex_lock(thread_mutex_t mutex) {
+    EnterCriticalSection((CRITICAL_SECTION*)mutex.handle);
+}
+
+void thread_mutex_unlock(thread_mutex_t mutex) {
+    LeaveCriticalSection((CRITICAL_SECTION*)mutex.handle);
+}
+#else
+static void* _thread_entry(void* ptr) {
+    _thread_start_t start = *(_thread_start_t*)ptr;
+    free(ptr);
+    start.func(start.arg);
+    return 0;
+}
+
+thread_t thread_start(thread_func_t func, void* arg) {
+    assert(func);
+    _thread_start_t* start = (_thread_start_t*) malloc(sizeof(_thread_start_t));
+    start->func = func;
+    start->arg = arg;
+    pthread_t* pthread = (pthread_t*) malloc(sizeof(pthread_t));
+    if (0 != pthread_create(pthread, 0, _thread_entry, start)) {
+        free(start);
+        free(pthread);
+        return (thread_t){ .handle = 0 };
+    }
+    return (thread_t){ .handle = pthread };
+}
+
+void thread_join(thread_t thread) {
+    if (thread.handle) {
+        pthread_join(*(pthread_t*)thread.handle, 0);
+        free(thread.handle);
+    }
+}
+
+int thread_num_cores(void) {
+    long num_cores = sysconf(_SC_NPROCESSORS_ONLN);
+    return (num_cores > 0) ? (int)num_cores : 1;
+}
+
+void thread_sleep_us(uint32_t us) {
+    struct timespec ts = {
+        .tv_sec = (time_t)(us / 1000000),
+        .tv_nsec = (long)(us % 1000000) * 1000
+    };
+    nanosleep(&ts, 0);
+}
+
+thread_mutex_t thread_mutex_create(void) {
+    pthread_mutex_t* mutex = (pthread_mutex_t*) malloc(sizeof(pthread_mutex_t));
+    pthread_mutex_init(mutex, 0);
+    return (thread_mutex_t){ .handle = mutex };
+}
+
+void thread_mutex_destroy(thread_mutex_t mutex) {
+    if (mutex.handle) {
+        pthread_mutex_destroy((pthread_mutex_t*)mutex.handle);
+        free(mutex.handle);
+    }
+}
+
+void thread_mutex_lock(thread_mutex_t mutex) {
+    pthread_mutex_lock((pthread_mutex_t*)mutex.handle);
+}
+
+void thread_mutex_unlock(thread_mutex_t mutex) {
+    pthread_mutex_unlock((pthread_mutex_t*)mutex.handle);
+}
+#endif
+#endif /* COMMON_IMPL */
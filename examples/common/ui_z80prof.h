@@ -0,0 +1,260 @@
+#pragma once
+/*
+    ui_z80prof.h -- Dear ImGui window for the Z80 hot-spot profiler
+
+    Shows the executed addresses of a z80prof_t sorted by T-states, with
+    execution count, share of all T-states and disassembly, or the called
+    routines sorted by inclusive T-states, with exclusive T-states and the
+    average inclusive T-states per video frame. The instruction table can
+    be dumped as CSV file, the call tree as folded stacks.
+
+    The profiler counts on the emulator thread, so draw the window while
+    the emulator is locked (same as ui_zx_draw()). The tables are only
+    collected from the profiler every UI_Z80PROF_UPDATE_INTERVAL seconds
+    (or on 'Refresh'), not in every frame.
+
+    Include after z80prof.h and imgui.h, the implementation is compiled
+    when CHIPS_UI_IMPL is defined (as C++).
+*/
+#include <stdint.h>
+#include <stdbool.h>
+
+#define UI_Z80PROF_UPDATE_INTERVAL (0.5)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct {
+    const char* title;
+    z80prof_t* prof;
+    chips_debug_t* debug;   // the emulator's debug hooks, the profiler is installed here
+    const char* csv_path;   // file written by the 'Save CSV' button
+    const char* folded_path;    // file written by the 'Save folded' button
+    int x, y;
+    int w, h;
+    bool open;
+} ui_z80prof_desc_t;
+
+typedef struct {
+    const char* title;
+    z80prof_t* prof;
+    chips_debug_t* debug;
+    const char* csv_path;
+    const char* folded_path;
+    float init_x, init_y;
+    float init_w, init_h;
+    bool open;
+    bool valid;
+    int mode;                   // 0: instructions, 1: routines
+    bool dirty;                 // update the tables in the next frame
+    double last_update;         // ImGui time of the last table update
+    int num_entries;
+    z80prof_entry_t* entries;   // Z80PROF_NUM_ADDRS items
+    int num_routines;
+    z80prof_routine_t* routines;    // Z80PROF_MAX_NODES items
+    char status[128];           // result of the last file dump
+} ui_z80prof_t;
+
+void ui_z80prof_init(ui_z80prof_t* win, const ui_z80prof_desc_t* desc);
+void ui_z80prof_discard(ui_z80prof_t* win);
+void ui_z80prof_draw(ui_z80prof_t* win);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+/*== IMPLEMENTATION ==========================================================*/
+#ifdef CHIPS_UI_IMPL
+#ifndef __cplusplus
+#error "implementation must be compiled as C++"
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef CHIPS_ASSERT
+    #include <assert.h>
+    #define CHIPS_ASSERT(c) assert(c)
+#endif
+
+void ui_z80prof_init(ui_z80prof_t* win, const ui_z80prof_desc_t* desc) {
+    CHIPS_ASSERT(win && desc && desc->title && desc->prof && desc->debug && desc->csv_path && desc->folded_path);
+    memset(win, 0, sizeof(ui_z80prof_t));
+    win->title = desc->title;
+    win->prof = desc->prof;
+    win->debug = desc->debug;
+    win->csv_path = desc->csv_path;
+    win->folded_path = desc->folded_path;
+    win->init_x = (float) desc->x;
+    win->init_y = (float) desc->y;
+    win->init_w = (float) ((desc->w == 0) ? 460 : desc->w);
+    win->init_h = (float) ((desc->h == 0) ? 400 : desc->h);
+    win->open = desc->open;
+    win->dirty = true;
+    win->entries = (z80prof_entry_t*) malloc(Z80PROF_NUM_ADDRS * sizeof(z80prof_entry_t));
+    win->routines = (z80prof_routine_t*) malloc(Z80PROF_MAX_NODES * sizeof(z80prof_routine_t));
+    CHIPS_ASSERT(win->entries && win->routines);
+    win->valid = true;
+}
+
+void ui_z80prof_discard(ui_z80prof_t* win) {
+    CHIPS_ASSERT(win && win->valid);
+    free(win->entries);
+    free(win->routines);
+    win->entries = 0;
+    win->routines = 0;
+    win->valid = false;
+}
+
+static void _ui_z80prof_draw_controls(ui_z80prof_t* win) {
+    bool enabled = win->prof->enabled;
+    if (ImGui::Checkbox("Enabled", &enabled)) {
+        if (enabled) {
+            z80prof_enable(win->prof, win->debug);
+        }
+        else {
+            z80prof_disable(win->prof, win->debug);
+        }
+    }
+    ImGui::SameLine();
+    if (ImGui::Button("Reset")) {
+        z80prof_reset(win->prof);
+        win->status[0] = 0;
+        win->dirty = true;
+    }
+    ImGui::SameLine();
+    if (ImGui::Button("Refresh")) {
+        win->dirty = true;
+    }
+    ImGui::SameLine();
+    if (ImGui::Button("Save CSV")) {
+        if (z80prof_write_csv(win->prof, win->csv_path)) {
+            snprintf(win->status, sizeof(win->status), "written to '%s'", win->csv_path);
+        }
+        else {
+            snprintf(win->status, sizeof(win->status), "failed to write '%s'", win->csv_path);
+        }
+    }
+    ImGui::SameLine();
+    if (ImGui::Button("Save folded")) {
+        if (z80prof_write_folded(win->prof, win->folded_path)) {
+            snprintf(win->status, sizeof(win->status), "written to '%s'", win->folded_path);
+        }
+        else {
+            snprintf(win->status, sizeof(win->status), "failed to write '%s'", win->folded_path);
+        }
+    }
+    if (win->status[0]) {
+        ImGui::Text("%s", win->status);
+    }
+    if (ImGui::RadioButton("Instructions", &win->mode, 0)) {
+        win->dirty = true;
+    }
+    ImGui::SameLine();
+    if (ImGui::RadioButton("Routines", &win->mode, 1)) {
+        win->dirty = true;
+    }
+    ImGui::SameLine();
+    if (0 == win->mode) {
+        ImGui::Text("%llu T-states in %d instructions", (unsigned long long)win->prof->total_ticks, win->num_entries);
+    }
+    else {
+        ImGui::Text("%d routines, call depth %d%s", win->num_routines, win->prof->depth, win->prof->tree_full ? " (call tree full)" : "");
+    }
+}
+
+static void _ui_z80prof_draw_table(ui_z80prof_t* win) {
+    const float col_count = 64.0f;
+    const float col_ticks = 160.0f;
+    const float col_percent = 256.0f;
+    const float col_dasm = 320.0f;
+    ImGui::Text("Addr");
+    ImGui::SameLine(col_count); ImGui::Text("Count");
+    ImGui::SameLine(col_ticks); ImGui::Text("T-states");
+    ImGui::SameLine(col_percent); ImGui::Text("%%");
+    ImGui::SameLine(col_dasm); ImGui::Text("Instruction");
+    ImGui::Separator();
+    ImGui::BeginChild("##z80prof_table", ImVec2(0, 0), false);
+    const double total_ticks = (double) win->prof->total_ticks;
+    ImGuiListClipper clipper;
+    clipper.Begin(win->num_entries);
+    while (clipper.Step()) {
+        for (int i = clipper.DisplayStart; i < clipper.DisplayEnd; i++) {
+            const z80prof_entry_t* e = &win->entries[i];
+            char dasm[32];
+            z80prof_disasm(win->prof, e->addr, dasm, sizeof(dasm));
+            ImGui::Text("%04X", e->addr);
+            ImGui::SameLine(col_count); ImGui::Text("%llu", (unsigned long long)e->count);
+            ImGui::SameLine(col_ticks); ImGui::Text("%llu", (unsigned long long)e->ticks);
+            ImGui::SameLine(col_percent); ImGui::Text("%.2f", (total_ticks > 0.0) ? (100.0 * (double)e->ticks / total_ticks) : 0.0);
+            ImGui::SameLine(col_dasm); ImGui::Text("%s", dasm);
+        }
+    }
+    clipper.End();
+    ImGui::EndChild();
+}
+
+static void _ui_z80prof_draw_routines(ui_z80prof_t* win) {
+    const float col_calls = 80.0f;
+    const float col_incl = 176.0f;
+    const float col_self = 272.0f;
+    const float col_frame = 368.0f;
+    ImGui::Text("Routine");
+    ImGui::SameLine(col_calls); ImGui::Text("Calls");
+    ImGui::SameLine(col_incl); ImGui::Text("Inclusive");
+    ImGui::SameLine(col_self); ImGui::Text("Exclusive");
+    ImGui::SameLine(col_frame); ImGui::Text("Incl/frame");
+    ImGui::Separator();
+    ImGui::BeginChild("##z80prof_routines", ImVec2(0, 0), false);
+    // average T-states per video frame over the profiled time
+    const double num_frames = (win->prof->frame_ticks > 0) ? ((double)win->prof->total_ticks / (double)win->prof->frame_ticks) : 0.0;
+    ImGuiListClipper clipper;
+    clipper.Begin(win->num_routines);
+    while (clipper.Step()) {
+        for (int i = clipper.DisplayStart; i < clipper.DisplayEnd; i++) {
+            const z80prof_routine_t* r = &win->routines[i];
+            ImGui::Text("%s_%04X", r->interrupt ? "int" : "sub", r->addr);
+            ImGui::SameLine(col_calls); ImGui::Text("%llu", (unsigned long long)r->calls);
+            ImGui::SameLine(col_incl); ImGui::Text("%llu", (unsigned long long)r->incl_ticks);
+            ImGui::SameLine(col_self); ImGui::Text("%llu", (unsigned long long)r->self_ticks);
+            if (num_frames >= 1.0) {
+                ImGui::SameLine(col_frame); ImGui::Text("%.0f", (double)r->incl_ticks / num_frames);
+            }
+        }
+    }
+    clipper.End();
+    ImGui::EndChild();
+}
+
+void ui_z80prof_draw(ui_z80prof_t* win) {
+    CHIPS_ASSERT(win && win->valid);
+    if (!win->open) {
+        return;
+    }
+    ImGui::SetNextWindowPos(ImVec2(win->init_x, win->init_y), ImGuiCond_Once);
+    ImGui::SetNextWindowSize(ImVec2(win->init_w, win->init_h), ImGuiCond_Once);
+    if (ImGui::Begin(win->title, &win->open)) {
+        // collecting and sorting the tables takes a while, and the emulator is locked meanwhile
+        const double now = ImGui::GetTime();
+        if (win->dirty || (win->prof->enabled && ((now - win->last_update) >= UI_Z80PROF_UPDATE_INTERVAL))) {
+            win->dirty = false;
+            win->last_update = now;
+            if (0 == win->mode) {
+                win->num_entries = z80prof_hotspots(win->prof, win->entries, Z80PROF_NUM_ADDRS);
+            }
+            else {
+                win->num_routines = z80prof_routines(win->prof, win->routines, Z80PROF_MAX_NODES);
+            }
+        }
+        _ui_z80prof_draw_controls(win);
+        ImGui::Separator();
+        if (0 == win->mode) {
+            _ui_z80prof_draw_table(win);
+        }
+        else {
+            _ui_z80prof_draw_routines(win);
+        }
+    }
+    ImGui::End();
+}
+#endif /* CHIPS_UI_IMPL */
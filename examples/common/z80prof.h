@@ -0,0 +1,558 @@
+#pragma once
+/*
+    z80prof.h -- guest-side hot-spot profiler for Z80 programs
+
+    Counts how often the instruction at each address is executed, and how
+    many T-states (CPU ticks) are spent in it. The profiler hooks into the
+    emulator's chips_debug_t callback, which is called after each tick,
+    and attributes the ticks between two z80_opdone() boundaries to the
+    instruction at the PC of the first boundary (the same PC the debugger
+    uses). Debug hooks which were installed before (e.g. the UI debugger)
+    are kept and called after the profiler.
+
+    While disabled the profiler isn't installed at all, so the emulator
+    runs its normal fast path without a per-tick callback.
+
+    Addresses are CPU addresses: with 128K memory banking, instructions in
+    different banks at the same address are counted together, and the
+    disassembly shows whatever is mapped at the address at the time.
+
+    For the call graph, the profiler keeps a shadow stack of the guest's
+    subroutine calls: a taken CALL or RST, and an interrupt acknowledge
+    cycle (M1|IORQ) push a frame, a RET, RETI or RETN pops frames up to the
+    one whose return address it jumps to (a RET to an address which isn't
+    on the shadow stack, e.g. after the program dropped a return address,
+    is treated as a jump). The opcode is only looked at when an instruction
+    doesn't continue with the next address. The distinct stacks form a call
+    tree, whose nodes collect the T-states spent in them, which gives the
+    inclusive and exclusive T-states per routine (z80prof_routines()) and
+    a folded-stacks file for flamegraph tools (z80prof_write_folded()).
+    The call stack at the time profiling is enabled is unknown, the code
+    running outside of any seen call is counted in the 'root' node.
+
+    Include after chips/z80.h, systems/zx.h (for chips_debug_t) and
+    util/z80dasm.h, the implementation is compiled when CHIPS_IMPL is
+    defined.
+*/
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define Z80PROF_NUM_ADDRS (1<<16)
+#define Z80PROF_MAX_DEPTH (64)
+#define Z80PROF_MAX_NODES (8192)
+
+// read a byte from the CPU address space for the disassembly
+typedef uint8_t (*z80prof_read_t)(uint16_t addr, void* user_data);
+
+typedef struct {
+    z80_t* cpu;
+    z80prof_read_t read_cb;
+    void* user_data;
+    uint32_t frame_ticks;   // optional, T-states per video frame for per-frame averages
+} z80prof_desc_t;
+
+typedef struct {
+    uint16_t addr;
+    uint64_t count;         // number of executions
+    uint64_t ticks;         // T-states spent in the instruction
+} z80prof_entry_t;
+
+typedef struct {
+    uint16_t addr;          // entry address of the routine
+    bool interrupt;         // entered by an interrupt instead of CALL/RST
+    uint64_t calls;
+    uint64_t incl_ticks;    // T-states including called routines
+    uint64_t self_ticks;    // T-states in the routine's own instructions
+} z80prof_routine_t;
+
+// a node in the call tree, node 0 is the root
+typedef struct {
+    uint16_t addr;
+    bool interrupt;
+    int parent;
+    int first_child;        // 0: no children
+    int next_sibling;       // 0: last child
+    uint64_t calls;
+    uint64_t self_ticks;
+} z80prof_node_t;
+
+// a frame on the shadow call stack
+typedef struct {
+    uint16_t ret_addr;
+    bool interrupt;
+    int node;
+} z80prof_frame_t;
+
+typedef struct {
+    bool valid;
+    bool enabled;
+    bool suspended;         // don't count while set (e.g. while running ahead)
+    z80_t* cpu;
+    z80prof_read_t read_cb;
+    void* user_data;
+    chips_debug_t chain;    // the debug hooks installed before the profiler
+    bool stopped;           // stop flag if the chained hooks have none
+    uint16_t cur_addr;      // start address of the current instruction
+    uint32_t cur_ticks;     // ticks spent so far in the current instruction
+    uint64_t total_ticks;
+    uint32_t frame_ticks;
+    uint64_t* counts;       // Z80PROF_NUM_ADDRS items
+    uint64_t* ticks;        // Z80PROF_NUM_ADDRS items
+    bool int_ack;           // an interrupt was acknowledged during the current instruction
+    bool tree_full;         // calls were attributed to the caller, because all nodes are used
+    int cur_node;
+    int depth;
+    z80prof_frame_t stack[Z80PROF_MAX_DEPTH];
+    int num_nodes;
+    z80prof_node_t* nodes;  // Z80PROF_MAX_NODES items
+} z80prof_t;
+
+// initialize a profiler (disabled)
+void z80prof_init(z80prof_t* prof, const z80prof_desc_t* desc);
+// free the profiler's counters
+void z80prof_discard(z80prof_t* prof);
+// install the profiler into the emulator's debug hooks, starts counting
+void z80prof_enable(z80prof_t* prof, chips_debug_t* debug);
+// restore the emulator's debug hooks, stops counting
+void z80prof_disable(z80prof_t* prof, chips_debug_t* debug);
+// clear all counters
+void z80prof_reset(z80prof_t* prof);
+// continue at the CPU's current PC with an empty shadow stack after the CPU state was replaced (e.g. rewind)
+void z80prof_resync(z80prof_t* prof);
+// get the executed addresses sorted by T-states (most first), returns number of entries
+int z80prof_hotspots(const z80prof_t* prof, z80prof_entry_t* entries, int max_entries);
+// disassemble the instruction at an address, returns the address of the next instruction
+uint16_t z80prof_disasm(const z80prof_t* prof, uint16_t addr, char* buf, size_t buf_size);
+// write all executed addresses with counts and disassembly as CSV file
+bool z80prof_write_csv(const z80prof_t* prof, const char* path);
+// get the called routines sorted by inclusive T-states (most first), returns number of routines
+int z80prof_routines(const z80prof_t* prof, z80prof_routine_t* routines, int max_routines);
+// write the call tree as folded stacks ('root;sub_8000;sub_9000 1234' per line)
+bool z80prof_write_folded(const z80prof_t* prof, const char* path);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+/*== IMPLEMENTATION ==========================================================*/
+#ifdef CHIPS_IMPL
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef CHIPS_ASSERT
+    #include <assert.h>
+    #define CHIPS_ASSERT(c) assert(c)
+#endif
+
+static void _z80prof_reset_stack(z80prof_t* prof) {
+    prof->depth = 0;
+    prof->cur_node = 0;
+    prof->int_ack = false;
+}
+
+// find or add the call tree node of a routine called from a node
+static int _z80prof_child_node(z80prof_t* prof, int parent, uint16_t addr, bool interrupt) {
+    z80prof_node_t* nodes = prof->nodes;
+    int prev = 0;
+    for (int i = nodes[parent].first_child; i != 0; prev = i, i = nodes[i].next_sibling) {
+        if ((nodes[i].addr == addr) && (nodes[i].interrupt == interrupt)) {
+            // move to the front, a routine is often called several times in a row
+            if (prev != 0) {
+                nodes[prev].next_sibling = nodes[i].next_sibling;
+                nodes[i].next_sibling = nodes[parent].first_child;
+                nodes[parent].first_child = i;
+            }
+            return i;
+        }
+    }
+    if (prof->num_nodes == Z80PROF_MAX_NODES) {
+        prof->tree_full = true;
+        return parent;
+    }
+    const int node = prof->num_nodes++;
+    memset(&nodes[node], 0, sizeof(z80prof_node_t));
+    nodes[node].addr = addr;
+    nodes[node].interrupt = interrupt;
+    nodes[node].parent = parent;
+    nodes[node].next_sibling = nodes[parent].first_child;
+    nodes[parent].first_child = node;
+    return node;
+}
+
+static void _z80prof_push(z80prof_t* prof, uint16_t addr, uint16_t ret_addr, bool interrupt) {
+    if (prof->depth == Z80PROF_MAX_DEPTH) {
+        // drop the outermost frame
+        memmove(&prof->stack[0], &prof->stack[1], (Z80PROF_MAX_DEPTH - 1) * sizeof(z80prof_frame_t));
+        prof->depth--;
+    }
+    const int node = _z80prof_child_node(prof, prof->cur_node, addr, interrupt);
+    if (node != prof->cur_node) {
+        prof->nodes[node].calls++;
+    }
+    z80prof_frame_t* frame = &prof->stack[prof->depth++];
+    frame->ret_addr = ret_addr;
+    frame->interrupt = interrupt;
+    frame->node = node;
+    prof->cur_node = node;
+}
+
+static void _z80prof_return(z80prof_t* prof, uint16_t addr) {
+    for (int i = prof->depth - 1; i >= 0; i--) {
+        const z80prof_frame_t* frame = &prof->stack[i];
+        // an interrupt during HALT returns behind the HALT instruction
+        if ((frame->ret_addr == addr) || (frame->interrupt && ((uint16_t)(frame->ret_addr + 1) == addr))) {
+            prof->depth = i;
+            prof->cur_node = (i > 0) ? prof->stack[i - 1].node : 0;
+            return;
+        }
+    }
+}
+
+// an instruction continued somewhere else than at the next address
+static void _z80prof_branch(z80prof_t* prof, uint16_t addr, uint16_t next_addr) {
+    uint16_t op_addr = addr;
+    uint8_t op = prof->read_cb(op_addr, prof->user_data);
+    while (((op == 0xDD) || (op == 0xFD)) && ((uint16_t)(op_addr - addr) < 4)) {
+        op = prof->read_cb(++op_addr, prof->user_data);
+    }
+    if ((op == 0xCD) || ((op & 0xC7) == 0xC4)) {
+        // CALL nn, CALL cc,nn
+        _z80prof_push(prof, next_addr, op_addr + 3, false);
+    }
+    else if ((op & 0xC7) == 0xC7) {
+        // RST p
+        _z80prof_push(prof, next_addr, op_addr + 1, false);
+    }
+    else if ((op == 0xC9) || ((op & 0xC7) == 0xC0)) {
+        // RET, RET cc
+        _z80prof_return(prof, next_addr);
+    }
+    else if ((op == 0xED) && ((prof->read_cb(op_addr + 1, prof->user_data) & 0xC7) == 0x45)) {
+        // RETN, RETI
+        _z80prof_return(prof, next_addr);
+    }
+}
+
+// an instruction (or interrupt response) has completed
+static void _z80prof_opdone(z80prof_t* prof) {
+    const uint16_t addr = prof->cur_addr;
+    const uint16_t next_addr = prof->cpu->pc;
+    // the interrupt response isn't an execution of the interrupted instruction
+    if (!prof->int_ack) {
+        prof->counts[addr]++;
+    }
+    prof->ticks[addr] += prof->cur_ticks;
+    prof->total_ticks += prof->cur_ticks;
+    prof->nodes[prof->cur_node].self_ticks += prof->cur_ticks;
+    if (prof->int_ack) {
+        prof->int_ack = false;
+        _z80prof_push(prof, next_addr, addr, true);
+    }
+    else {
+        const uint16_t dist = next_addr - addr;
+        if ((dist == 0) || (dist > 4)) {
+            _z80prof_branch(prof, addr, next_addr);
+        }
+    }
+    prof->cur_ticks = 0;
+    prof->cur_addr = next_addr;
+}
+
+// called by the emulator after each tick while enabled
+static void _z80prof_tick(void* user_data, uint64_t pins) {
+    z80prof_t* prof = (z80prof_t*) user_data;
+    if (!prof->suspended) {
+        prof->cur_ticks++;
+        if ((pins & (Z80_M1|Z80_IORQ)) == (Z80_M1|Z80_IORQ)) {
+            prof->int_ack = true;
+        }
+        if (z80_opdone(prof->cpu)) {
+            _z80prof_opdone(prof);
+        }
+    }
+    if (prof->chain.callback.func) {
+        prof->chain.callback.func(prof->chain.callback.user_data, pins);
+    }
+}
+
+void z80prof_init(z80prof_t* prof, const z80prof_desc_t* desc) {
+    CHIPS_ASSERT(prof && desc && desc->cpu && desc->read_cb);
+    memset(prof, 0, sizeof(z80prof_t));
+    prof->cpu = desc->cpu;
+    prof->read_cb = desc->read_cb;
+    prof->user_data = desc->user_data;
+    prof->frame_ticks = desc->frame_ticks;
+    prof->counts = (uint64_t*) calloc(Z80PROF_NUM_ADDRS, sizeof(uint64_t));
+    prof->ticks = (uint64_t*) calloc(Z80PROF_NUM_ADDRS, sizeof(uint64_t));
+    prof->nodes = (z80prof_node_t*) calloc(Z80PROF_MAX_NODES, sizeof(z80prof_node_t));
+    CHIPS_ASSERT(prof->counts && prof->ticks && prof->nodes);
+    prof->num_nodes = 1;
+    prof->valid = true;
+}
+
+void z80prof_discard(z80prof_t* prof) {
+    CHIPS_ASSERT(prof && prof->valid);
+    free(prof->counts);
+    free(prof->ticks);
+    free(prof->nodes);
+    prof->counts = 0;
+    prof->ticks = 0;
+    prof->nodes = 0;
+    prof->valid = false;
+}
+
+void z80prof_enable(z80prof_t* prof, chips_debug_t* debug) {
+    CHIPS_ASSERT(prof && prof->valid && debug);
+    if (prof->enabled) {
+        return;
+    }
+    // chaining to itself would recurse forever
+    CHIPS_ASSERT(debug->callback.func != _z80prof_tick);
+    prof->chain = *debug;
+    prof->stopped = false;
+    prof->cur_addr = prof->cpu->pc;
+    prof->cur_ticks = 0;
+    _z80prof_reset_stack(prof);
+    debug->callback.func = _z80prof_tick;
+    debug->callback.user_data = prof;
+    // the emulator checks the stop flag while a debug callback is installed
+    if (0 == debug->stopped) {
+        debug->stopped = &prof->stopped;
+    }
+    prof->enabled = true;
+}
+
+void z80prof_disable(z80prof_t* prof, chips_debug_t* debug) {
+    CHIPS_ASSERT(prof && prof->valid && debug);
+    if (!prof->enabled) {
+        return;
+    }
+    *debug = prof->chain;
+    prof->enabled = false;
+}
+
+void z80prof_reset(z80prof_t* prof) {
+    CHIPS_ASSERT(prof && prof->valid);
+    memset(prof->counts, 0, Z80PROF_NUM_ADDRS * sizeof(uint64_t));
+    memset(prof->ticks, 0, Z80PROF_NUM_ADDRS * sizeof(uint64_t));
+    prof->total_ticks = 0;
+    prof->cur_ticks = 0;
+    memset(&prof->nodes[0], 0, sizeof(z80prof_node_t));
+    prof->num_nodes = 1;
+    prof->tree_full = false;
+    _z80prof_reset_stack(prof);
+}
+
+void z80prof_resync(z80prof_t* prof) {
+    CHIPS_ASSERT(prof && prof->valid);
+    prof->cur_addr = prof->cpu->pc;
+    prof->cur_ticks = 0;
+    _z80prof_reset_stack(prof);
+}
+
+static int _z80prof_cmp_entries(const void* a, const void* b) {
+    const z80prof_entry_t* ea = (const z80prof_entry_t*) a;
+    const z80prof_entry_t* eb = (const z80prof_entry_t*) b;
+    if (ea->ticks != eb->ticks) {
+        return (ea->ticks > eb->ticks) ? -1 : 1;
+    }
+    return (int)ea->addr - (int)eb->addr;
+}
+
+int z80prof_hotspots(const z80prof_t* prof, z80prof_entry_t* entries, int max_entries) {
+    CHIPS_ASSERT(prof && prof->valid && entries && (max_entries > 0));
+    // collect all addresses before truncating, so that the hottest ones are kept
+    z80prof_entry_t* all = entries;
+    if (max_entries < Z80PROF_NUM_ADDRS) {
+        all = (z80prof_entry_t*) malloc(Z80PROF_NUM_ADDRS * sizeof(z80prof_entry_t));
+        CHIPS_ASSERT(all);
+    }
+    int num_entries = 0;
+    for (int addr = 0; addr < Z80PROF_NUM_ADDRS; addr++) {
+        if (prof->counts[addr] > 0) {
+            z80prof_entry_t* e = &all[num_entries++];
+            e->addr = (uint16_t) addr;
+            e->count = prof->counts[addr];
+            e->ticks = prof->ticks[addr];
+        }
+    }
+    qsort(all, (size_t)num_entries, sizeof(z80prof_entry_t), _z80prof_cmp_entries);
+    if (all != entries) {
+        if (num_entries > max_entries) {
+            num_entries = max_entries;
+        }
+        memcpy(entries, all, (size_t)num_entries * sizeof(z80prof_entry_t));
+        free(all);
+    }
+    return num_entries;
+}
+
+typedef struct {
+    const z80prof_t* prof;
+    uint16_t addr;
+    char* buf;
+    size_t buf_size;
+    size_t len;
+} _z80prof_dasm_t;
+
+static uint8_t _z80prof_dasm_in(void* user_data) {
+    _z80prof_dasm_t* dasm = (_z80prof_dasm_t*) user_data;
+    return dasm->prof->read_cb(dasm->addr++, dasm->prof->user_data);
+}
+
+static void _z80prof_dasm_out(char c, void* user_data) {
+    _z80prof_dasm_t* dasm = (_z80prof_dasm_t*) user_data;
+    if ((dasm->len + 1) < dasm->buf_size) {
+        dasm->buf[dasm->len++] = c;
+    }
+}
+
+uint16_t z80prof_disasm(const z80prof_t* prof, uint16_t addr, char* buf, size_t buf_size) {
+    CHIPS_ASSERT(prof && prof->valid && buf && (buf_size > 0));
+    _z80prof_dasm_t dasm = { .prof = prof, .addr = addr, .buf = buf, .buf_size = buf_size, .len = 0 };
+    const uint16_t next_addr = z80dasm_op(addr, _z80prof_dasm_in, _z80prof_dasm_out, &dasm);
+    buf[dasm.len] = 0;
+    return next_addr;
+}
+
+bool z80prof_write_csv(const z80prof_t* prof, const char* path) {
+    CHIPS_ASSERT(prof && prof->valid && path);
+    FILE* fp = fopen(path, "w");
+    if (!fp) {
+        return false;
+    }
+    z80prof_entry_t* entries = (z80prof_entry_t*) malloc(Z80PROF_NUM_ADDRS * sizeof(z80prof_entry_t));
+    CHIPS_ASSERT(entries);
+    const int num_entries = z80prof_hotspots(prof, entries, Z80PROF_NUM_ADDRS);
+    fprintf(fp, "address,executions,tstates,percent,instruction\n");
+    for (int i = 0; i < num_entries; i++) {
+        const z80prof_entry_t* e = &entries[i];
+        char dasm[32];
+        z80prof_disasm(prof, e->addr, dasm, sizeof(dasm));
+        fprintf(fp, "%04X,%llu,%llu,%.3f,\"%s\"\n",
+            e->addr,
+            (unsigned long long)e->count,
+            (unsigned long long)e->ticks,
+            (prof->total_ticks > 0) ? (100.0 * (double)e->ticks / (double)prof->total_ticks) : 0.0,
+            dasm);
+    }
+    free(entries);
+    return 0 == fclose(fp);
+}
+
+typedef struct {
+    uint32_t key;           // routine address | interrupt flag << 16
+    int node;
+} _z80prof_node_key_t;
+
+static uint32_t _z80prof_node_key(const z80prof_node_t* node) {
+    return node->addr | (node->interrupt ? 0x10000 : 0);
+}
+
+static int _z80prof_cmp_node_keys(const void* a, const void* b) {
+    const _z80prof_node_key_t* ka = (const _z80prof_node_key_t*) a;
+    const _z80prof_node_key_t* kb = (const _z80prof_node_key_t*) b;
+    if (ka->key != kb->key) {
+        return (ka->key < kb->key) ? -1 : 1;
+    }
+    return ka->node - kb->node;
+}
+
+static int _z80prof_cmp_routines(const void* a, const void* b) {
+    const z80prof_routine_t* ra = (const z80prof_routine_t*) a;
+    const z80prof_routine_t* rb = (const z80prof_routine_t*) b;
+    if (ra->incl_ticks != rb->incl_ticks) {
+        return (ra->incl_ticks > rb->incl_ticks) ? -1 : 1;
+    }
+    return (int)ra->addr - (int)rb->addr;
+}
+
+/* a routine's nodes are all places in the call tree it was called from,
+   the inclusive T-states of recursive calls are already contained in
+   the outermost call
+*/
+int z80prof_routines(const z80prof_t* prof, z80prof_routine_t* routines, int max_routines) {
+    CHIPS_ASSERT(prof && prof->valid && routines && (max_routines > 0));
+    const int num_nodes = prof->num_nodes;
+    const z80prof_node_t* nodes = prof->nodes;
+    uint64_t* totals = (uint64_t*) malloc((size_t)num_nodes * sizeof(uint64_t));
+    _z80prof_node_key_t* keys = (_z80prof_node_key_t*) malloc((size_t)num_nodes * sizeof(_z80prof_node_key_t));
+    CHIPS_ASSERT(totals && keys);
+    // children are always added after their parent
+    for (int i = 0; i < num_nodes; i++) {
+        totals[i] = nodes[i].self_ticks;
+    }
+    for (int i = num_nodes - 1; i > 0; i--) {
+        totals[nodes[i].parent] += totals[i];
+    }
+    int num_keys = 0;
+    for (int i = 1; i < num_nodes; i++) {
+        keys[num_keys].key = _z80prof_node_key(&nodes[i]);
+        keys[num_keys].node = i;
+        num_keys++;
+    }
+    qsort(keys, (size_t)num_keys, sizeof(_z80prof_node_key_t), _z80prof_cmp_node_keys);
+    int num_routines = 0;
+    for (int i = 0; i < num_keys; i++) {
+        const z80prof_node_t* node = &nodes[keys[i].node];
+        if ((0 == i) || (keys[i].key != keys[i - 1].key)) {
+            if (num_routines == max_routines) {
+                break;
+            }
+            z80prof_routine_t* r = &routines[num_routines++];
+            memset(r, 0, sizeof(z80prof_routine_t));
+            r->addr = node->addr;
+            r->interrupt = node->interrupt;
+        }
+        z80prof_routine_t* r = &routines[num_routines - 1];
+        r->calls += node->calls;
+        r->self_ticks += node->self_ticks;
+        bool recursive = false;
+        for (int p = node->parent; p != 0; p = nodes[p].parent) {
+            if (_z80prof_node_key(&nodes[p]) == keys[i].key) {
+                recursive = true;
+                break;
+            }
+        }
+        if (!recursive) {
+            r->incl_ticks += totals[keys[i].node];
+        }
+    }
+    free(keys);
+    free(totals);
+    qsort(routines, (size_t)num_routines, sizeof(z80prof_routine_t), _z80prof_cmp_routines);
+    return num_routines;
+}
+
+bool z80prof_write_folded(const z80prof_t* prof, const char* path) {
+    CHIPS_ASSERT(prof && prof->valid && path);
+    FILE* fp = fopen(path, "w");
+    if (!fp) {
+        return false;
+    }
+    int* path_nodes = (int*) malloc((size_t)prof->num_nodes * sizeof(int));
+    CHIPS_ASSERT(path_nodes);
+    for (int i = 0; i < prof->num_nodes; i++) {
+        if (0 == prof->nodes[i].self_ticks) {
+            continue;
+        }
+        int len = 0;
+        for (int n = i; n != 0; n = prof->nodes[n].parent) {
+            path_nodes[len++] = n;
+        }
+        fprintf(fp, "root");
+        while (len > 0) {
+            const z80prof_node_t* node = &prof->nodes[path_nodes[--len]];
+            fprintf(fp, ";%s_%04X", node->interrupt ? "int" : "sub", node->addr);
+        }
+        fprintf(fp, " %llu\n", (unsigned long long)prof->nodes[i].self_ticks);
+    }
+    free(path_nodes);
+    return 0 == fclose(fp);
+}
+#endif /* CHIPS_IMPL */
@@ -0,0 +1,63 @@
+#pragma once
+/*
+    zxframe.h -- run the ZX Spectrum emulator in step with its video frames
+
+    zx_exec() runs for a given emulated time, which usually ends somewhere
+    in the middle of a video frame, so the framebuffer holds the bottom of
+    the previous and the top of the current frame. zx_exec_frames() splits
+    the time slice at the end of each video frame (when the scanline
+    counter wraps around to the top) and calls a callback while the
+    framebuffer holds exactly one complete frame, e.g. to capture or
+    publish it. A split overshoots the frame end by at most one scanline,
+    which isn't displayed.
+
+    The split points depend only on the emulator state, but splitting the
+    time slice changes the rounding of microseconds to ticks, so don't use
+    this where the number of ticks per slice must stay fixed (movies).
+
+    Include after systems/zx.h, the implementation is compiled when
+    CHIPS_IMPL is defined.
+*/
+#include <stdint.h>
+#include <stdbool.h>
+
+/* called when the emulator has finished a video frame */
+typedef void (*zx_frame_callback_t)(zx_t* sys, void* user_data);
+
+/* number of T-states per video frame */
+uint32_t zx_frame_ticks(zx_type_t type);
+/* run the emulator like zx_exec(), calling 'callback' at the end of each video frame, returns the executed ticks */
+uint32_t zx_exec_frames(zx_t* sys, uint32_t micro_seconds, zx_frame_callback_t callback, void* user_data);
+
+/*== IMPLEMENTATION ==========================================================*/
+#ifdef CHIPS_IMPL
+#ifndef CHIPS_ASSERT
+    #include <assert.h>
+    #define CHIPS_ASSERT(c) assert(c)
+#endif
+
+uint32_t zx_frame_ticks(zx_type_t type) {
+    return (type == ZX_TYPE_48K) ? 69888 : 70908;
+}
+
+uint32_t zx_exec_frames(zx_t* sys, uint32_t micro_seconds, zx_frame_callback_t callback, void* user_data) {
+    CHIPS_ASSERT(sys && callback);
+    uint32_t ticks = 0;
+    while (micro_seconds > 0) {
+        // run to the end of the frame, overshooting by at most one scanline
+        const int lines_left = sys->frame_scan_lines - sys->scanline_y;
+        const uint64_t ticks_left = (uint64_t)((lines_left > 0) ? lines_left : 0) * (uint64_t)sys->scanline_period;
+        uint32_t slice_us = (uint32_t)((ticks_left * 1000000) / sys->freq_hz) + 1;
+        if (slice_us > micro_seconds) {
+            slice_us = micro_seconds;
+        }
+        const int scanline_y = sys->scanline_y;
+        ticks += zx_exec(sys, slice_us);
+        micro_seconds -= slice_us;
+        if (sys->scanline_y < scanline_y) {
+            callback(sys, user_data);
+        }
+    }
+    return ticks;
+}
+#endif /* CHIPS_IMPL */
@@ -0,0 +1,274 @@
+#pragma once
+/*
+    zxmovie.h -- deterministic input recording and replay for the ZX Spectrum
+
+    A movie is a save-state (see zxstate.h) to start from, plus the list of
+    key events, each stamped with the number of emulated ticks since the
+    start of the movie.
+
+    While a movie is recorded or played back, the emulator runs in fixed
+    ZX_MOVIE_FRAME_TIME_US slices (call zx_movie_exec_frame() as often as
+    the host's frame time requires), and key events are only applied
+    between two slices. The emulator thus always stops at the same
+    instruction boundaries, and a replay produces bit-identical results at
+    any host speed. A recorded tick stamp which doesn't fall on a slice
+    boundary during playback means the replay has desynced (e.g. the movie
+    was recorded with a different chips version), this is reported in
+    zx_movie_t.desync.
+
+    File layout (all offsets 64-byte aligned):
+
+        +0              zx_movie_header_t
+        +state_offset   save-state, zx_state_size() bytes
+        +events_offset  num_events * zx_movie_event_t
+
+    Include after systems/zx.h and zxstate.h, the implementation is compiled
+    when CHIPS_IMPL is defined.
+*/
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define ZX_MOVIE_MAGIC (0x564D585A)     // 'ZXMV' in memory on little-endian
+#define ZX_MOVIE_VERSION (1)
+// emulated time per fixed slice while recording or playing back
+#define ZX_MOVIE_FRAME_TIME_US (20000)
+
+typedef struct {
+    uint32_t magic;             // ZX_MOVIE_MAGIC
+    uint32_t version;           // ZX_MOVIE_VERSION
+    uint32_t frame_time_us;     // ZX_MOVIE_FRAME_TIME_US
+    uint32_t num_events;
+    uint64_t num_ticks;         // duration of the movie in emulated ticks
+    uint32_t state_offset;
+    uint32_t state_size;
+    uint32_t events_offset;
+    uint32_t event_size;        // sizeof(zx_movie_event_t)
+    uint32_t reserved[6];
+} zx_movie_header_t;
+
+typedef struct {
+    uint64_t tick;              // emulated ticks since the start of the movie
+    uint8_t key_code;           // same key code as passed to zx_key_down/up()
+    uint8_t down;               // 1: key down, 0: key up
+    uint8_t reserved[6];
+} zx_movie_event_t;
+
+typedef struct {
+    bool recording;
+    bool playing;
+    bool desync;                // playback hit an event between two slices
+    uint64_t tick;              // emulated ticks since the start of the movie
+    uint64_t num_ticks;         // duration of a movie being played back
+    int cur_event;              // next event to play back
+    int num_events;
+    int max_events;
+    zx_movie_event_t* events;
+    uint8_t* start_state;       // save-state the movie starts from
+} zx_movie_t;
+
+/* start recording from the emulator's current state */
+void zx_movie_record(zx_movie_t* movie, const zx_t* sys);
+/* start playback of a movie file, restores the start state into sys, returns false on a malformed file */
+bool zx_movie_play(zx_movie_t* movie, zx_t* sys, const void* ptr, size_t num_bytes);
+/* stop recording or playback (the recorded data is kept until zx_movie_discard) */
+void zx_movie_stop(zx_movie_t* movie);
+/* free the movie's memory */
+void zx_movie_discard(zx_movie_t* movie);
+/* true while recording or playing back */
+bool zx_movie_active(const zx_movie_t* movie);
+/* forward a key press to the emulator and record it (ignored during playback) */
+void zx_movie_key_down(zx_movie_t* movie, zx_t* sys, int key_code);
+/* forward a key release to the emulator and record it (ignored during playback) */
+void zx_movie_key_up(zx_movie_t* movie, zx_t* sys, int key_code);
+/* apply due key events and run one ZX_MOVIE_FRAME_TIME_US slice, returns executed ticks */
+uint32_t zx_movie_exec_frame(zx_movie_t* movie, zx_t* sys);
+/* number of bytes needed to save the recorded movie */
+size_t zx_movie_data_size(const zx_movie_t* movie);
+/* write the recorded movie into a buffer, returns false if the buffer is too small */
+bool zx_movie_save(const zx_movie_t* movie, void* ptr, size_t num_bytes);
+
+/*== IMPLEMENTATION ==========================================================*/
+#ifdef CHIPS_IMPL
+#include <string.h>
+#include <stdlib.h>
+#ifndef CHIPS_ASSERT
+    #include <assert.h>
+    #define CHIPS_ASSERT(c) assert(c)
+#endif
+
+#define _ZX_MOVIE_ALIGN(s) ((((s) + 63) / 64) * 64)
+#define _ZX_MOVIE_STATE_OFFSET (_ZX_MOVIE_ALIGN(sizeof(zx_movie_header_t)))
+#define _ZX_MOVIE_EVENTS_OFFSET (_ZX_MOVIE_STATE_OFFSET + _ZX_MOVIE_ALIGN(zx_state_size()))
+
+static void _zx_movie_reset(zx_movie_t* movie) {
+    movie->recording = false;
+    movie->playing = false;
+    movie->desync = false;
+    movie->tick = 0;
+    movie->num_ticks = 0;
+    movie->cur_event = 0;
+    movie->num_events = 0;
+}
+
+static void _zx_movie_alloc(zx_movie_t* movie, int num_events) {
+    if (!movie->start_state) {
+        movie->start_state = (uint8_t*) malloc(zx_state_size());
+        CHIPS_ASSERT(movie->start_state);
+    }
+    if (num_events > movie->max_events) {
+        movie->max_events = num_events;
+        movie->events = (zx_movie_event_t*) realloc(movie->events, (size_t)num_events * sizeof(zx_movie_event_t));
+        CHIPS_ASSERT(movie->events);
+    }
+}
+
+void zx_movie_record(zx_movie_t* movie, const zx_t* sys) {
+    CHIPS_ASSERT(movie && sys);
+    _zx_movie_reset(movie);
+    _zx_movie_alloc(movie, 1024);
+    zx_save_state(sys, movie->start_state, zx_state_size());
+    movie->recording = true;
+}
+
+bool zx_movie_play(zx_movie_t* movie, zx_t* sys, const void* ptr, size_t num_bytes) {
+    CHIPS_ASSERT(movie && sys && ptr);
+    _zx_movie_reset(movie);
+    if (num_bytes < _ZX_MOVIE_EVENTS_OFFSET) {
+        return false;
+    }
+    const uint8_t* src = (const uint8_t*) ptr;
+    zx_movie_header_t hdr;
+    memcpy(&hdr, src, sizeof(hdr));
+    if ((hdr.magic != ZX_MOVIE_MAGIC) ||
+        (hdr.version != ZX_MOVIE_VERSION) ||
+        (hdr.frame_time_us != ZX_MOVIE_FRAME_TIME_US) ||
+        (hdr.state_offset != _ZX_MOVIE_STATE_OFFSET) ||
+        (hdr.state_size != zx_state_size()) ||
+        (hdr.events_offset != _ZX_MOVIE_EVENTS_OFFSET) ||
+        (hdr.event_size != sizeof(zx_movie_event_t)) ||
+        (num_bytes < (hdr.events_offset + (size_t)hdr.num_events * sizeof(zx_movie_event_t))))
+    {
+        return false;
+    }
+    _zx_movie_alloc(movie, (int)hdr.num_events);
+    memcpy(movie->start_state, src + hdr.state_offset, hdr.state_size);
+    if (!zx_load_state(sys, movie->start_state, hdr.state_size)) {
+        return false;
+    }
+    if (hdr.num_events > 0) {
+        memcpy(movie->events, src + hdr.events_offset, hdr.num_events * sizeof(zx_movie_event_t));
+    }
+    movie->num_events = (int)hdr.num_events;
+    movie->num_ticks = hdr.num_ticks;
+    movie->playing = true;
+    return true;
+}
+
+void zx_movie_stop(zx_movie_t* movie) {
+    CHIPS_ASSERT(movie);
+    if (movie->recording) {
+        movie->num_ticks = movie->tick;
+    }
+    movie->recording = false;
+    movie->playing = false;
+}
+
+void zx_movie_discard(zx_movie_t* movie) {
+    CHIPS_ASSERT(movie);
+    free(movie->events);
+    free(movie->start_state);
+    memset(movie, 0, sizeof(zx_movie_t));
+}
+
+bool zx_movie_active(const zx_movie_t* movie) {
+    CHIPS_ASSERT(movie);
+    return movie->recording || movie->playing;
+}
+
+static void _zx_movie_record_key(zx_movie_t* movie, int key_code, bool down) {
+    if (movie->num_events == movie->max_events) {
+        _zx_movie_alloc(movie, movie->max_events * 2);
+    }
+    zx_movie_event_t* ev = &movie->events[movie->num_events++];
+    memset(ev, 0, sizeof(zx_movie_event_t));
+    ev->tick = movie->tick;
+    ev->key_code = (uint8_t) key_code;
+    ev->down = down ? 1 : 0;
+}
+
+void zx_movie_key_down(zx_movie_t* movie, zx_t* sys, int key_code) {
+    CHIPS_ASSERT(movie && sys);
+    if (movie->playing) {
+        return;
+    }
+    if (movie->recording) {
+        _zx_movie_record_key(movie, key_code, true);
+    }
+    zx_key_down(sys, key_code);
+}
+
+void zx_movie_key_up(zx_movie_t* movie, zx_t* sys, int key_code) {
+    CHIPS_ASSERT(movie && sys);
+    if (movie->playing) {
+        return;
+    }
+    if (movie->recording) {
+        _zx_movie_record_key(movie, key_code, false);
+    }
+    zx_key_up(sys, key_code);
+}
+
+uint32_t zx_movie_exec_frame(zx_movie_t* movie, zx_t* sys) {
+    CHIPS_ASSERT(movie && sys);
+    if (movie->playing) {
+        while ((movie->cur_event < movie->num_events) && (movie->events[movie->cur_event].tick <= movie->tick)) {
+            const zx_movie_event_t* ev = &movie->events[movie->cur_event++];
+            if (ev->tick != movie->tick) {
+                movie->desync = true;
+            }
+            if (ev->down) {
+                zx_key_down(sys, ev->key_code);
+            }
+            else {
+                zx_key_up(sys, ev->key_code);
+            }
+        }
+    }
+    const uint32_t ticks = zx_exec(sys, ZX_MOVIE_FRAME_TIME_US);
+    movie->tick += ticks;
+    if (movie->playing && (movie->tick >= movie->num_ticks) && (movie->cur_event >= movie->num_events)) {
+        movie->playing = false;
+    }
+    return ticks;
+}
+
+size_t zx_movie_data_size(const zx_movie_t* movie) {
+    CHIPS_ASSERT(movie);
+    return _ZX_MOVIE_EVENTS_OFFSET + (size_t)movie->num_events * sizeof(zx_movie_event_t);
+}
+
+bool zx_movie_save(const zx_movie_t* movie, void* ptr, size_t num_bytes) {
+    CHIPS_ASSERT(movie && ptr);
+    if (!movie->start_state || (num_bytes < zx_movie_data_size(movie))) {
+        return false;
+    }
+    uint8_t* dst = (uint8_t*) ptr;
+    memset(dst, 0, _ZX_MOVIE_EVENTS_OFFSET);
+    zx_movie_header_t* hdr = (zx_movie_header_t*) dst;
+    hdr->magic = ZX_MOVIE_MAGIC;
+    hdr->version = ZX_MOVIE_VERSION;
+    hdr->frame_time_us = ZX_MOVIE_FRAME_TIME_US;
+    hdr->num_events = (uint32_t) movie->num_events;
+    hdr->num_ticks = movie->recording ? movie->tick : movie->num_ticks;
+    hdr->state_offset = (uint32_t) _ZX_MOVIE_STATE_OFFSET;
+    hdr->state_size = (uint32_t) zx_state_size();
+    hdr->events_offset = (uint32_t) _ZX_MOVIE_EVENTS_OFFSET;
+    hdr->event_size = (uint32_t) sizeof(zx_movie_event_t);
+    memcpy(dst + hdr->state_offset, movie->start_state, hdr->state_size);
+    if (movie->num_events > 0) {
+        memcpy(dst + hdr->events_offset, movie->events, (size_t)movie->num_events * sizeof(zx_movie_event_t));
+    }
+    return true;
+}
+#endif /* CHIPS_IMPL */
@@ -0,0 +1,164 @@
+#pragma once
+/*
+    zxstate.h -- versioned binary save-states for the ZX Spectrum emulator
+
+    A save-state is a 64-byte header followed by a verbatim image of the
+    zx_t struct (CPU, AY, beeper, keyboard matrix, memory and all other
+    emulator state) at a 64-byte aligned offset:
+
+        +0      zx_state_header_t (magic, version, sizes, offsets)
+        +64     zx_t image
+
+    The memory-mapping pointers inside the image are stored as offsets
+    relative to the zx_t, so a save-state can be written to a file,
+    mmap'ed or read back and restored into any zx_t instance. Loading
+    checks the fixed-size header, does one memcpy of the image and patches
+    the few pointers, nothing is parsed byte by byte.
+
+    The layout depends on the chips version and compiler ABI, so the header
+    also records the zx_t size and pointer size, and loading rejects states
+    which don't match. Bump ZX_STATE_VERSION when the layout changes in a
+    way the size check doesn't catch.
+
+    Host-side connections (pixel buffer, audio callback, debug hooks) are
+    not part of the save-state, loading keeps those of the target instance.
+
+    Include after systems/zx.h, the implementation is compiled when
+    CHIPS_IMPL is defined.
+*/
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define ZX_STATE_MAGIC (0x5453585A)     // 'ZXST' in memory on little-endian
+#define ZX_STATE_VERSION (1)
+#define ZX_STATE_ALIGN (64)
+
+typedef struct {
+    uint32_t magic;             // ZX_STATE_MAGIC
+    uint32_t version;           // ZX_STATE_VERSION
+    uint32_t header_size;       // sizeof(zx_state_header_t)
+    uint32_t state_offset;      // offset of the zx_t image from the start of the header
+    uint32_t state_size;        // sizeof(zx_t)
+    uint32_t ptr_size;          // sizeof(void*)
+    uint32_t type;              // zx_type_t of the saved system
+    uint32_t reserved[9];
+} zx_state_header_t;
+
+/* number of bytes needed for a save-state */
+size_t zx_state_size(void);
+/* write the emulator state into a buffer, returns false if the buffer is too small */
+bool zx_save_state(const zx_t* sys, void* ptr, size_t num_bytes);
+/* restore the emulator state from a buffer, returns false if the header doesn't match */
+bool zx_load_state(zx_t* sys, const void* ptr, size_t num_bytes);
+
+/*== IMPLEMENTATION ==========================================================*/
+#ifdef CHIPS_IMPL
+#include <string.h>
+#ifndef CHIPS_ASSERT
+    #include <assert.h>
+    #define CHIPS_ASSERT(c) assert(c)
+#endif
+
+#define _ZX_STATE_OFFSET (((sizeof(zx_state_header_t) + ZX_STATE_ALIGN - 1) / ZX_STATE_ALIGN) * ZX_STATE_ALIGN)
+
+size_t zx_state_size(void) {
+    return _ZX_STATE_OFFSET + sizeof(zx_t);
+}
+
+/* pointers into the zx_t are stored as offset+1 from the start of the
+   zx_t, pointers outside (e.g. the memory system's shared unmapped page)
+   are stored as 0 and taken over from the target instance when loading
+*/
+static uintptr_t _zx_state_ptr_to_offset(const zx_t* sys, const void* ptr) {
+    const uintptr_t base = (uintptr_t) sys;
+    const uintptr_t p = (uintptr_t) ptr;
+    if ((p >= base) && (p < (base + sizeof(zx_t)))) {
+        return (p - base) + 1;
+    }
+    else {
+        return 0;
+    }
+}
+
+static void _zx_state_save_page(const zx_t* sys, mem_page_t* dst, const mem_page_t* src) {
+    dst->read_ptr = (const uint8_t*) _zx_state_ptr_to_offset(sys, src->read_ptr);
+    dst->write_ptr = (uint8_t*) _zx_state_ptr_to_offset(sys, src->write_ptr);
+}
+
+static void _zx_state_load_page(zx_t* sys, mem_page_t* dst, const mem_page_t* prev) {
+    const uintptr_t read_offset = (uintptr_t) dst->read_ptr;
+    const uintptr_t write_offset = (uintptr_t) dst->write_ptr;
+    dst->read_ptr = read_offset ? ((const uint8_t*)sys + (read_offset - 1)) : prev->read_ptr;
+    dst->write_ptr = write_offset ? ((uint8_t*)sys + (write_offset - 1)) : prev->write_ptr;
+}
+
+bool zx_save_state(const zx_t* sys, void* ptr, size_t num_bytes) {
+    CHIPS_ASSERT(sys && ptr);
+    if (num_bytes < zx_state_size()) {
+        return false;
+    }
+    uint8_t* dst = (uint8_t*) ptr;
+    memset(dst, 0, _ZX_STATE_OFFSET);
+    zx_state_header_t* hdr = (zx_state_header_t*) dst;
+    hdr->magic = ZX_STATE_MAGIC;
+    hdr->version = ZX_STATE_VERSION;
+    hdr->header_size = (uint32_t) sizeof(zx_state_header_t);
+    hdr->state_offset = (uint32_t) _ZX_STATE_OFFSET;
+    hdr->state_size = (uint32_t) sizeof(zx_t);
+    hdr->ptr_size = (uint32_t) sizeof(void*);
+    hdr->type = (uint32_t) sys->type;
+    zx_t* img = (zx_t*) (dst + _ZX_STATE_OFFSET);
+    memcpy(img, sys, sizeof(zx_t));
+    for (int layer = 0; layer < MEM_NUM_LAYERS; layer++) {
+        for (int i = 0; i < (int)MEM_NUM_PAGES; i++) {
+            _zx_state_save_page(sys, &img->mem.layers[layer][i], &sys->mem.layers[layer][i]);
+        }
+    }
+    for (int i = 0; i < (int)MEM_NUM_PAGES; i++) {
+        _zx_state_save_page(sys, &img->mem.page_table[i], &sys->mem.page_table[i]);
+    }
+    // host-side connections are meaningless outside this process
+    img->pixel_buffer = 0;
+    memset(&img->audio.callback, 0, sizeof(img->audio.callback));
+    memset(&img->debug, 0, sizeof(img->debug));
+    return true;
+}
+
+bool zx_load_state(zx_t* sys, const void* ptr, size_t num_bytes) {
+    CHIPS_ASSERT(sys && ptr);
+    if (num_bytes < zx_state_size()) {
+        return false;
+    }
+    const uint8_t* src = (const uint8_t*) ptr;
+    zx_state_header_t hdr;
+    memcpy(&hdr, src, sizeof(hdr));
+    if ((hdr.magic != ZX_STATE_MAGIC) ||
+        (hdr.version != ZX_STATE_VERSION) ||
+        (hdr.header_size != sizeof(zx_state_header_t)) ||
+        (hdr.state_offset != _ZX_STATE_OFFSET) ||
+        (hdr.state_size != sizeof(zx_t)) ||
+        (hdr.ptr_size != sizeof(void*)))
+    {
+        return false;
+    }
+    // keep the target's host-side connections and unmapped-page pointers
+    uint32_t* pixel_buffer = sys->pixel_buffer;
+    const chips_audio_callback_t audio_callback = sys->audio.callback;
+    const chips_debug_t debug = sys->debug;
+    const mem_t prev_mem = sys->mem;
+    memcpy(sys, src + _ZX_STATE_OFFSET, sizeof(zx_t));
+    for (int layer = 0; layer < MEM_NUM_LAYERS; layer++) {
+        for (int i = 0; i < (int)MEM_NUM_PAGES; i++) {
+            _zx_state_load_page(sys, &sys->mem.layers[layer][i], &prev_mem.layers[layer][i]);
+        }
+    }
+    for (int i = 0; i < (int)MEM_NUM_PAGES; i++) {
+        _zx_state_load_page(sys, &sys->mem.page_table[i], &prev_mem.page_table[i]);
+    }
+    sys->pixel_buffer = pixel_buffer;
+    sys->audio.callback = audio_callback;
+    sys->debug = debug;
+    return true;
+}
+#endif /* CHIPS_IMPL */
@@ -0,0 +1,155 @@
+#pragma once
+/*
+    pngwrite.h -- minimal PNG writer for framebuffer screenshots
+
+    Writes 8-bit RGB PNG files without compression (the deflate stream
+    only contains 'stored' blocks), so that no zlib dependency is needed.
+    A 320x256 ZX Spectrum screenshot ends up at about 250 KBytes, which
+    any image viewer or diff tool can open.
+
+    The writer keeps no global state and can be called from several
+    threads at once.
+
+    The implementation is compiled when COMMON_IMPL is defined.
+*/
+#include <stdint.h>
+#include <stdbool.h>
+
+/* write RGBA8 pixels (R in the lowest byte, alpha is ignored) as PNG file */
+bool png_write(const char* path, const uint32_t* pixels, int width, int height);
+
+/*== IMPLEMENTATION ==========================================================*/
+#ifdef COMMON_IMPL
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+// max payload of a deflate 'stored' block
+#define _PNG_MAX_STORED_BLOCK (65535)
+
+typedef struct {
+    FILE* fp;
+    uint32_t crc_table[256];
+    uint32_t crc;               // CRC of the current chunk
+    uint32_t adler_a;           // Adler-32 of the zlib stream
+    uint32_t adler_b;
+    bool error;
+} _png_writer_t;
+
+static void _png_put_u32(uint8_t* dst, uint32_t val) {
+    dst[0] = (uint8_t) (val >> 24);
+    dst[1] = (uint8_t) (val >> 16);
+    dst[2] = (uint8_t) (val >> 8);
+    dst[3] = (uint8_t) val;
+}
+
+// write bytes and update the chunk CRC
+static void _png_write(_png_writer_t* png, const uint8_t* ptr, size_t num_bytes) {
+    uint32_t crc = png->crc;
+    for (size_t i = 0; i < num_bytes; i++) {
+        crc = png->crc_table[(crc ^ ptr[i]) & 0xFF] ^ (crc >> 8);
+    }
+    png->crc = crc;
+    if (num_bytes != fwrite(ptr, 1, num_bytes, png->fp)) {
+        png->error = true;
+    }
+}
+
+static void _png_begin_chunk(_png_writer_t* png, const char* type, uint32_t size) {
+    uint8_t buf[4];
+    _png_put_u32(buf, size);
+    if (4 != fwrite(buf, 1, 4, png->fp)) {
+        png->error = true;
+    }
+    png->crc = 0xFFFFFFFF;
+    _png_write(png, (const uint8_t*)type, 4);
+}
+
+static void _png_end_chunk(_png_writer_t* png) {
+    uint8_t buf[4];
+    _png_put_u32(buf, png->crc ^ 0xFFFFFFFF);
+    if (4 != fwrite(buf, 1, 4, png->fp)) {
+        png->error = true;
+    }
+}
+
+// write uncompressed image data bytes and update the Adler-32 checksum
+static void _png_write_data(_png_writer_t* png, const uint8_t* ptr, size_t num_bytes) {
+    for (size_t i = 0; i < num_bytes; i++) {
+        png->adler_a = (png->adler_a + ptr[i]) % 65521;
+        png->adler_b = (png->adler_b + png->adler_a) % 65521;
+    }
+    _png_write(png, ptr, num_bytes);
+}
+
+bool png_write(const char* path, const uint32_t* pixels, int width, int height) {
+    assert(path && pixels && (width > 0) && (height > 0));
+    _png_writer_t png;
+    memset(&png, 0, sizeof(png));
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) {
+            c = (c & 1) ? (0xEDB88320 ^ (c >> 1)) : (c >> 1);
+        }
+        png.crc_table[i] = c;
+    }
+    png.adler_a = 1;
+    png.fp = fopen(path, "wb");
+    if (!png.fp) {
+        return false;
+    }
+    static const uint8_t signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+    png.error = (sizeof(signature) != fwrite(signature, 1, sizeof(signature), png.fp));
+
+    // IHDR: 8-bit RGB, no interlacing
+    uint8_t ihdr[13] = { 0 };
+    _png_put_u32(ihdr + 0, (uint32_t)width);
+    _png_put_u32(ihdr + 4, (uint32_t)height);
+    ihdr[8] = 8;
+    ihdr[9] = 2;
+    _png_begin_chunk(&png, "IHDR", sizeof(ihdr));
+    _png_write(&png, ihdr, sizeof(ihdr));
+    _png_end_chunk(&png);
+
+    // IDAT: zlib header, one stored block per scanline (filter byte
+    // plus RGB data), Adler-32 trailer
+    const size_t row_size = 1 + 3 * (size_t)width;
+    assert(row_size <= _PNG_MAX_STORED_BLOCK);
+    const size_t idat_size = 2 + (size_t)height * (5 + row_size) + 4;
+    uint8_t* row = (uint8_t*) malloc(row_size);
+    assert(row);
+    _png_begin_chunk(&png, "IDAT", (uint32_t)idat_size);
+    static const uint8_t zlib_header[2] = { 0x78, 0x01 };
+    _png_write(&png, zlib_header, sizeof(zlib_header));
+    for (int y = 0; y < height; y++) {
+        const uint16_t len = (uint16_t) row_size;
+        const uint16_t nlen = (uint16_t) ~len;
+        const uint8_t block_header[5] = {
+            (uint8_t)((y == (height - 1)) ? 1 : 0),     // BFINAL on the last block, BTYPE=00 (stored)
+            (uint8_t)len, (uint8_t)(len >> 8),
+            (uint8_t)nlen, (uint8_t)(nlen >> 8),
+        };
+        _png_write(&png, block_header, sizeof(block_header));
+        const uint32_t* src = pixels + y * width;
+        row[0] = 0;     // filter type 'none'
+        for (int x = 0; x < width; x++) {
+            const uint32_t c = src[x];
+            row[1 + x * 3 + 0] = (uint8_t) c;
+            row[1 + x * 3 + 1] = (uint8_t) (c >> 8);
+            row[1 + x * 3 + 2] = (uint8_t) (c >> 16);
+        }
+        _png_write_data(&png, row, row_size);
+    }
+    uint8_t adler[4];
+    _png_put_u32(adler, (png.adler_b << 16) | png.adler_a);
+    _png_write(&png, adler, sizeof(adler));
+    _png_end_chunk(&png);
+    free(row);
+
+    _png_begin_chunk(&png, "IEND", 0);
+    _png_end_chunk(&png);
+    const bool success = !png.error && (0 == fclose(png.fp));
+    return success;
+}
+#endif /* COMMON_IMPL */
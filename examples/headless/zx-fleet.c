@@ -0,0 +1,505 @@
+//------------------------------------------------------------------------------
+//  zx-fleet.c
+//
+//  Run many headless ZX Spectrum instances in parallel on a work-stealing
+//  thread pool. Each job boots a machine, loads a snapshot (and optionally
+//  types an input script), runs a number of frames and reports its result.
+//
+//  Usage:
+//  fips run zx-fleet -- --frames 1000 webpage/zx/*.z80
+//  fips run zx-fleet -- --jobs jobs.txt --threads 8 --repeat 4
+//
+//  A jobs file has one job per line, the file path followed by an optional
+//  keyboard input script separated by whitespace, e.g.:
+//
+//  webpage/zx/batty.z80 ${wait:50}0
+//
+//  Visual regression mode: each job's last frame is reduced to a perceptual
+//  hash and compared against a hashes file (one '<hash> <path>' per line),
+//  --update writes the file instead, --png saves the frames for inspection:
+//
+//  fips run zx-fleet -- --frames 500 --hashes zx-hashes.txt --update webpage/zx/*.z80
+//  fips run zx-fleet -- --frames 500 --hashes zx-hashes.txt --png out webpage/zx/*.z80
+//------------------------------------------------------------------------------
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#define CHIPS_IMPL
+#include "chips/z80.h"
+#include "chips/beeper.h"
+#include "chips/ay38910.h"
+#include "chips/kbd.h"
+#include "chips/clk.h"
+#include "chips/mem.h"
+#include "systems/zx.h"
+#include "zx-roms.h"
+#include "zxstate.h"
+#include "zxmovie.h"
+#include "zxframe.h"
+#define COMMON_IMPL
+#include "keybuf.h"
+#include "thread.h"
+#include "zxrun.h"
+#include "pngwrite.h"
+#define SOKOL_IMPL
+#include "sokol_time.h"
+#include "getopt.h"
+
+#define MAX_JOBS (4096)
+#define MAX_WORKERS (256)
+#define MAX_LINE_SIZE (1024)
+#define MAX_PATH_SIZE (1024)
+// default max bit distance of two matching perceptual hashes
+#define DEFAULT_HASH_THRESHOLD (4)
+
+static const struct getopt_option option_list[] = {
+    { "help", 'h', GETOPT_OPTION_TYPE_NO_ARG, 0, 'h', "print this help text", 0},
+    { "jobs", 'j', GETOPT_OPTION_TYPE_REQUIRED, 0, 'j', "file with one job per line (path and optional input)", "path"},
+    { "type", 't', GETOPT_OPTION_TYPE_REQUIRED, 0, 't', "machine type (zx48k or zx128)", "type"},
+    { "frames", 'n', GETOPT_OPTION_TYPE_REQUIRED, 0, 'n', "number of 50 Hz frames per job (default: 500)", "num"},
+    { "threads", 'p', GETOPT_OPTION_TYPE_REQUIRED, 0, 'p', "number of worker threads (default: number of cores)", "num"},
+    { "repeat", 'r', GETOPT_OPTION_TYPE_REQUIRED, 0, 'r', "run each job this many times (default: 1)", "num"},
+    { "hashes", 'c', GETOPT_OPTION_TYPE_REQUIRED, 0, 'c', "compare the perceptual hashes against a reference file", "path"},
+    { "update", 'u', GETOPT_OPTION_TYPE_NO_ARG, 0, 'u', "write the perceptual hashes to the --hashes file instead of comparing", 0},
+    { "threshold", 'd', GETOPT_OPTION_TYPE_REQUIRED, 0, 'd', "max bit distance of matching perceptual hashes (default: 4)", "num"},
+    { "png", 'o', GETOPT_OPTION_TYPE_REQUIRED, 0, 'o', "write a PNG of each job's last frame into a directory", "dir"},
+    GETOPT_OPTIONS_END
+};
+
+static char help_buf[2048];
+
+typedef struct {
+    const char* file_path;
+    const char* input;
+    // results
+    bool success;
+    int worker;
+    uint64_t num_ticks;
+    double time_s;
+    uint64_t hash;
+    uint64_t phash;
+    bool png_written;
+} job_t;
+
+// a reference hash loaded from the --hashes file
+typedef struct {
+    const char* file_path;
+    uint64_t phash;
+} ref_hash_t;
+
+// a worker's job queue, the owner pops from the back, thieves steal from the front
+typedef struct {
+    thread_mutex_t lock;
+    int front;
+    int back;
+    int* items;
+} job_queue_t;
+
+typedef struct {
+    int index;
+    thread_t thread;
+    job_queue_t queue;
+    int num_stolen;
+} worker_t;
+
+static struct {
+    zx_type_t type;
+    int num_frames;
+    int num_jobs;
+    int num_unique_jobs;    // jobs before --repeat copies
+    job_t jobs[MAX_JOBS];
+    const char* png_dir;
+    int num_ref_hashes;
+    ref_hash_t ref_hashes[MAX_JOBS];
+    int num_workers;
+    worker_t workers[MAX_WORKERS];
+} state;
+
+static bool add_job(const char* file_path, const char* input) {
+    if (state.num_jobs >= MAX_JOBS) {
+        fprintf(stderr, "too many jobs (max %d)\n", MAX_JOBS);
+        return false;
+    }
+    state.jobs[state.num_jobs++] = (job_t){ .file_path = file_path, .input = input };
+    return true;
+}
+
+// load jobs from a text file, the strings are kept alive until the process exits
+static bool load_jobs(const char* path) {
+    FILE* fp = fopen(path, "r");
+    if (!fp) {
+        fprintf(stderr, "failed to open jobs file '%s'\n", path);
+        return false;
+    }
+    char line[MAX_LINE_SIZE];
+    while (fgets(line, sizeof(line), fp)) {
+        line[strcspn(line, "\r\n")] = 0;
+        char* file_path = line + strspn(line, " \t");
+        if ((file_path[0] == 0) || (file_path[0] == '#')) {
+            continue;
+        }
+        char* input = 0;
+        char* sep = file_path + strcspn(file_path, " \t");
+        if (*sep) {
+            *sep++ = 0;
+            sep += strspn(sep, " \t");
+            if (*sep) {
+                input = strdup(sep);
+            }
+        }
+        if (!add_job(strdup(file_path), input)) {
+            fclose(fp);
+            return false;
+        }
+    }
+    fclose(fp);
+    return true;
+}
+
+// load reference hashes, the strings are kept alive until the process exits
+static bool load_ref_hashes(const char* path) {
+    FILE* fp = fopen(path, "r");
+    if (!fp) {
+        fprintf(stderr, "failed to open hashes file '%s'\n", path);
+        return false;
+    }
+    char line[MAX_LINE_SIZE];
+    while (fgets(line, sizeof(line), fp)) {
+        line[strcspn(line, "\r\n")] = 0;
+        int num_frames = 0;
+        if (1 == sscanf(line, "# frames: %d", &num_frames)) {
+            if (num_frames != state.num_frames) {
+                fprintf(stderr, "warning: hashes in '%s' were taken after %d frames, running %d frames\n", path, num_frames, state.num_frames);
+            }
+            continue;
+        }
+        if ((line[0] == 0) || (line[0] == '#')) {
+            continue;
+        }
+        unsigned long long phash = 0;
+        int path_pos = 0;
+        if ((1 != sscanf(line, "%llx %n", &phash, &path_pos)) || (path_pos == 0) || (line[path_pos] == 0)) {
+            fprintf(stderr, "malformed line in hashes file '%s': %s\n", path, line);
+            fclose(fp);
+            return false;
+        }
+        if (state.num_ref_hashes >= MAX_JOBS) {
+            fprintf(stderr, "too many hashes in '%s' (max %d)\n", path, MAX_JOBS);
+            fclose(fp);
+            return false;
+        }
+        state.ref_hashes[state.num_ref_hashes++] = (ref_hash_t){ .file_path = strdup(line + path_pos), .phash = phash };
+    }
+    fclose(fp);
+    return true;
+}
+
+static const ref_hash_t* find_ref_hash(const char* file_path) {
+    for (int i = 0; i < state.num_ref_hashes; i++) {
+        if (0 == strcmp(state.ref_hashes[i].file_path, file_path)) {
+            return &state.ref_hashes[i];
+        }
+    }
+    return 0;
+}
+
+static bool save_ref_hashes(const char* path) {
+    FILE* fp = fopen(path, "w");
+    if (!fp) {
+        fprintf(stderr, "failed to write hashes file '%s'\n", path);
+        return false;
+    }
+    fprintf(fp, "# zx-fleet perceptual hashes\n# frames: %d\n", state.num_frames);
+    for (int i = 0; i < state.num_unique_jobs; i++) {
+        const job_t* job = &state.jobs[i];
+        if (job->success) {
+            fprintf(fp, "%016llX %s\n", (unsigned long long)job->phash, job->file_path);
+        }
+    }
+    fclose(fp);
+    return true;
+}
+
+// write the job's last frame to <png_dir>/<file name without extension>.png
+static bool write_png(const zxrun_t* run, const char* file_path) {
+    const char* name = file_path;
+    for (const char* p = file_path; *p; p++) {
+        if ((*p == '/') || (*p == '\\')) {
+            name = p + 1;
+        }
+    }
+    const char* dot = strrchr(name, '.');
+    const int name_len = dot ? (int)(dot - name) : (int)strlen(name);
+    char path[MAX_PATH_SIZE];
+    snprintf(path, sizeof(path), "%s/%.*s.png", state.png_dir, name_len, name);
+    if (!png_write(path, run->pixels, zx_std_display_width(), zx_std_display_height())) {
+        fprintf(stderr, "failed to write '%s'\n", path);
+        return false;
+    }
+    return true;
+}
+
+static bool queue_pop(job_queue_t* queue, int* out_job) {
+    bool res = false;
+    thread_mutex_lock(queue->lock);
+    if (queue->back > queue->front) {
+        *out_job = queue->items[--queue->back];
+        res = true;
+    }
+    thread_mutex_unlock(queue->lock);
+    return res;
+}
+
+static bool queue_steal(job_queue_t* queue, int* out_job) {
+    bool res = false;
+    thread_mutex_lock(queue->lock);
+    if (queue->back > queue->front) {
+        *out_job = queue->items[queue->front++];
+        res = true;
+    }
+    thread_mutex_unlock(queue->lock);
+    return res;
+}
+
+static void run_job(worker_t* worker, job_t* job) {
+    zxrun_t* run = (zxrun_t*) malloc(sizeof(zxrun_t));
+    job->worker = worker->index;
+    const uint64_t start_time = stm_now();
+    job->success = zxrun_init(run, &(zxrun_desc_t){ .type=state.type, .file_path=job->file_path, .input=job->input });
+    for (int frame = 0; job->success && (frame < state.num_frames); frame++) {
+        job->success = zxrun_frame(run);
+    }
+    job->time_s = stm_sec(stm_since(start_time));
+    job->num_ticks = run->num_ticks;
+    if (job->success) {
+        job->hash = zxrun_framebuffer_hash(run);
+        job->phash = zxrun_framebuffer_phash(run);
+        // repeated jobs produce the same frame, only write it once
+        if (state.png_dir && ((job - state.jobs) < state.num_unique_jobs)) {
+            job->png_written = write_png(run, job->file_path);
+        }
+    }
+    zxrun_discard(run);
+    free(run);
+}
+
+static void worker_func(void* arg) {
+    worker_t* worker = (worker_t*) arg;
+    int job_index;
+    while (true) {
+        if (!queue_pop(&worker->queue, &job_index)) {
+            // own queue is empty, try to steal from the other workers
+            bool stolen = false;
+            for (int i = 1; (i < state.num_workers) && !stolen; i++) {
+                worker_t* victim = &state.workers[(worker->index + i) % state.num_workers];
+                stolen = queue_steal(&victim->queue, &job_index);
+            }
+            if (!stolen) {
+                // all queues are empty, and jobs are never added while running
+                return;
+            }
+            worker->num_stolen++;
+        }
+        run_job(worker, &state.jobs[job_index]);
+    }
+}
+
+int main(int argc, const char** argv) {
+    getopt_context_t ctx;
+    if (getopt_create_context(&ctx, argc, argv, option_list) < 0) {
+        fprintf(stderr, "getopt_create_context() failed!\n");
+        return 10;
+    }
+    state.type = ZX_TYPE_128;
+    state.num_frames = 500;
+    state.num_workers = thread_num_cores();
+    int num_repeat = 1;
+    const char* hashes_path = 0;
+    bool update_hashes = false;
+    int hash_threshold = DEFAULT_HASH_THRESHOLD;
+    int opt;
+    while (((opt = getopt_next(&ctx)) != -1)) {
+        switch (opt) {
+            case '+':
+                // arguments without flag are snapshot files
+                if (!add_job(ctx.current_opt_arg, 0)) {
+                    return 10;
+                }
+                break;
+            case '?':
+                fprintf(stderr, "unknown flag %s\n", ctx.current_opt_arg);
+                return 10;
+            case '!':
+                fprintf(stderr, "invalid use of flag %s\n", ctx.current_opt_arg);
+                return 10;
+            case 'h':
+                fprintf(stderr, "zx-fleet -- run many headless ZX Spectrum instances in parallel\n\n");
+                fprintf(stderr, "%s", getopt_create_help_string(&ctx, help_buf, sizeof(help_buf)));
+                return 0;
+            case 'j':
+                if (!load_jobs(ctx.current_opt_arg)) {
+                    return 10;
+                }
+                break;
+            case 't':
+                if (0 == strcmp(ctx.current_opt_arg, "zx48k")) {
+                    state.type = ZX_TYPE_48K;
+                }
+                else if (0 != strcmp(ctx.current_opt_arg, "zx128")) {
+                    fprintf(stderr, "unknown machine type %s (expected zx48k or zx128)\n", ctx.current_opt_arg);
+                    return 10;
+                }
+                break;
+            case 'n':
+                state.num_frames = atoi(ctx.current_opt_arg);
+                break;
+            case 'p':
+                state.num_workers = atoi(ctx.current_opt_arg);
+                break;
+            case 'r':
+                num_repeat = atoi(ctx.current_opt_arg);
+                break;
+            case 'c':
+                hashes_path = ctx.current_opt_arg;
+                break;
+            case 'u':
+                update_hashes = true;
+                break;
+            case 'd':
+                hash_threshold = atoi(ctx.current_opt_arg);
+                break;
+            case 'o':
+                state.png_dir = ctx.current_opt_arg;
+                break;
+            default:
+                break;
+        }
+    }
+    if (state.num_jobs == 0) {
+        fprintf(stderr, "no jobs given (pass snapshot files or --jobs, -j)\n");
+        return 10;
+    }
+    if (state.num_frames <= 0) {
+        fprintf(stderr, "number of frames must be > 0 (--frames, -n)\n");
+        return 10;
+    }
+    if ((state.num_workers <= 0) || (state.num_workers > MAX_WORKERS)) {
+        fprintf(stderr, "number of threads must be between 1 and %d (--threads, -p)\n", MAX_WORKERS);
+        return 10;
+    }
+    if (update_hashes && !hashes_path) {
+        fprintf(stderr, "--update needs a hashes file (--hashes, -c)\n");
+        return 10;
+    }
+    if (hashes_path && !update_hashes && !load_ref_hashes(hashes_path)) {
+        return 10;
+    }
+    state.num_unique_jobs = state.num_jobs;
+    for (int r = 1; r < num_repeat; r++) {
+        for (int i = 0; i < state.num_unique_jobs; i++) {
+            if (!add_job(state.jobs[i].file_path, state.jobs[i].input)) {
+                return 10;
+            }
+        }
+    }
+
+    // distribute the jobs round-robin over the worker queues
+    stm_setup();
+    for (int w = 0; w < state.num_workers; w++) {
+        worker_t* worker = &state.workers[w];
+        worker->index = w;
+        worker->queue.lock = thread_mutex_create();
+        worker->queue.items = (int*) malloc((size_t)state.num_jobs * sizeof(int));
+    }
+    for (int i = state.num_jobs - 1; i >= 0; i--) {
+        job_queue_t* queue = &state.workers[i % state.num_workers].queue;
+        queue->items[queue->back++] = i;
+    }
+    const uint64_t start_time = stm_now();
+    for (int w = 0; w < state.num_workers; w++) {
+        state.workers[w].thread = thread_start(worker_func, &state.workers[w]);
+        if (!state.workers[w].thread.handle) {
+            fprintf(stderr, "failed to start worker thread %d\n", w);
+            return 10;
+        }
+    }
+    for (int w = 0; w < state.num_workers; w++) {
+        thread_join(state.workers[w].thread);
+    }
+    const double wall_time_s = stm_sec(stm_since(start_time));
+
+    // per-instance results
+    int num_failed = 0;
+    int num_stolen = 0;
+    uint64_t total_ticks = 0;
+    double total_job_time_s = 0.0;
+    int num_matched = 0;
+    int num_mismatched = 0;
+    int num_missing = 0;
+    const bool compare = hashes_path && !update_hashes;
+    printf("%-5s %-6s %-10s %8s %-16s %-16s %-8s %s\n", "job", "worker", "ticks", "time", "hash", "phash", compare ? "check" : "", "file");
+    for (int i = 0; i < state.num_jobs; i++) {
+        const job_t* job = &state.jobs[i];
+        char check[32] = "";
+        if (compare && job->success) {
+            const ref_hash_t* ref = find_ref_hash(job->file_path);
+            if (!ref) {
+                snprintf(check, sizeof(check), "NEW");
+                num_missing++;
+            }
+            else {
+                const int dist = zxrun_phash_distance(job->phash, ref->phash);
+                if (dist <= hash_threshold) {
+                    snprintf(check, sizeof(check), "ok(%d)", dist);
+                    num_matched++;
+                }
+                else {
+                    snprintf(check, sizeof(check), "DIFF(%d)", dist);
+                    num_mismatched++;
+                }
+            }
+        }
+        printf("%-5d %-6d %-10llu %7.3fs %016llX %016llX %-8s %s%s\n",
+            i,
+            job->worker,
+            (unsigned long long)job->num_ticks,
+            job->time_s,
+            (unsigned long long)job->hash,
+            (unsigned long long)job->phash,
+            check,
+            job->file_path,
+            job->success ? "" : " (FAILED)");
+        if (!job->success || (state.png_dir && (i < state.num_unique_jobs) && !job->png_written)) {
+            num_failed++;
+        }
+        total_ticks += job->num_ticks;
+        total_job_time_s += job->time_s;
+    }
+    for (int w = 0; w < state.num_workers; w++) {
+        num_stolen += state.workers[w].num_stolen;
+        thread_mutex_destroy(state.workers[w].queue.lock);
+        free(state.workers[w].queue.items);
+    }
+    printf("\njobs: %d (%d failed), threads: %d, stolen: %d, wall time: %.3fs, emulated: %.2f MHz, parallel speedup: %.2fx\n",
+        state.num_jobs,
+        num_failed,
+        state.num_workers,
+        num_stolen,
+        wall_time_s,
+        (wall_time_s > 0.0) ? ((double)total_ticks / wall_time_s) / 1000000.0 : 0.0,
+        (wall_time_s > 0.0) ? total_job_time_s / wall_time_s : 0.0);
+    if (compare) {
+        printf("regression: %d matched, %d different, %d without reference (threshold: %d bits)\n",
+            num_matched,
+            num_mismatched,
+            num_missing,
+            hash_threshold);
+    }
+    if (update_hashes && !save_ref_hashes(hashes_path)) {
+        return 10;
+    }
+    const bool regression = (num_mismatched > 0) || (num_missing > 0);
+    return ((num_failed > 0) || regression) ? 10 : 0;
+}
@@ -0,0 +1,246 @@
+//------------------------------------------------------------------------------
+//  zx-headless.c
+//
+//  Run the ZX Spectrum emulator without a window, 3D-API or audio device.
+//  The emulator renders into an in-memory framebuffer, audio samples are
+//  discarded, and frames are emulated back-to-back as fast as the host
+//  allows.
+//
+//  Usage:
+//  fips run zx-headless -- --file game.z80 --frames 1000
+//  fips run zx-headless -- --type zx48k --input "10 PRINT 1\n" --frames 500
+//  fips run zx-headless -- --file game.z80 --frames 300 --save-state game.zxs
+//  fips run zx-headless -- --load-state game.zxs --frames 1000
+//  fips run zx-headless -- --type zx48k --input "10 PRINT 1\n" --record-movie test.zxm
+//  fips run zx-headless -- --movie test.zxm
+//  fips run zx-headless -- --movie test.zxm --capture test.y4m --capture-audio test.wav
+//  fips run zx-headless -- --file game.z80 --frames 3000 --capture - | ffmpeg -i - game.mp4
+//------------------------------------------------------------------------------
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#define CHIPS_IMPL
+#include "chips/z80.h"
+#include "chips/beeper.h"
+#include "chips/ay38910.h"
+#include "chips/kbd.h"
+#include "chips/clk.h"
+#include "chips/mem.h"
+#include "systems/zx.h"
+#include "zx-roms.h"
+#include "zxstate.h"
+#include "zxmovie.h"
+#include "zxframe.h"
+#define COMMON_IMPL
+#include "keybuf.h"
+#include "thread.h"
+#include "capture.h"
+#include "zxrun.h"
+#define SOKOL_IMPL
+#include "sokol_time.h"
+#include "getopt.h"
+
+static const struct getopt_option option_list[] = {
+    { "help", 'h', GETOPT_OPTION_TYPE_NO_ARG, 0, 'h', "print this help text", 0},
+    { "file", 'f', GETOPT_OPTION_TYPE_REQUIRED, 0, 'f', "file to load (.z80, .txt or .bas)", "path"},
+    { "type", 't', GETOPT_OPTION_TYPE_REQUIRED, 0, 't', "machine type (zx48k or zx128)", "type"},
+    { "input", 'i', GETOPT_OPTION_TYPE_REQUIRED, 0, 'i', "keyboard input to type into the emulator", "text"},
+    { "save-state", 's', GETOPT_OPTION_TYPE_REQUIRED, 0, 's', "write the emulator state to a file after the run", "path"},
+    { "load-state", 'l', GETOPT_OPTION_TYPE_REQUIRED, 0, 'l', "start from a save-state file", "path"},
+    { "movie", 'm', GETOPT_OPTION_TYPE_REQUIRED, 0, 'm', "play back a movie file (--file and --input are ignored)", "path"},
+    { "record-movie", 'r', GETOPT_OPTION_TYPE_REQUIRED, 0, 'r', "record the keyboard input into a movie file", "path"},
+    { "capture", 'c', GETOPT_OPTION_TYPE_REQUIRED, 0, 'c', "write the video output to a file ('-' for stdout)", "path"},
+    { "capture-audio", 'a', GETOPT_OPTION_TYPE_REQUIRED, 0, 'a', "write the audio output to a WAV file", "path"},
+    { "capture-format", 'F', GETOPT_OPTION_TYPE_REQUIRED, 0, 'F', "video capture format (y4m or rgba, default: y4m)", "format"},
+    { "frames", 'n', GETOPT_OPTION_TYPE_REQUIRED, 0, 'n', "number of 50 Hz frames to emulate (default: 500)", "num"},
+    GETOPT_OPTIONS_END
+};
+
+static char help_buf[2048];
+
+static zxrun_t run;
+
+static void capture_push_audio(const float* samples, int num_samples, void* user_data) {
+    (void)user_data;
+    capture_audio(samples, num_samples);
+}
+
+static void capture_push_video(const uint32_t* pixels, int width, int height, void* user_data) {
+    (void)user_data;
+    capture_frame(pixels, width, height);
+}
+
+int main(int argc, const char** argv) {
+    getopt_context_t ctx;
+    if (getopt_create_context(&ctx, argc, argv, option_list) < 0) {
+        fprintf(stderr, "getopt_create_context() failed!\n");
+        return 10;
+    }
+    const char* file_path = 0;
+    const char* input = 0;
+    const char* save_state_path = 0;
+    const char* load_state_path = 0;
+    const char* movie_path = 0;
+    const char* record_movie_path = 0;
+    const char* capture_path = 0;
+    const char* capture_audio_path = 0;
+    capture_format_t capture_format = CAPTURE_FORMAT_Y4M;
+    zx_type_t type = ZX_TYPE_128;
+    int num_frames = 500;
+    int opt;
+    while (((opt = getopt_next(&ctx)) != -1)) {
+        switch (opt) {
+            case '+':
+                fprintf(stderr, "got argument without flag: %s\n", ctx.current_opt_arg);
+                return 10;
+            case '?':
+                fprintf(stderr, "unknown flag %s\n", ctx.current_opt_arg);
+                return 10;
+            case '!':
+                fprintf(stderr, "invalid use of flag %s\n", ctx.current_opt_arg);
+                return 10;
+            case 'h':
+                fprintf(stderr, "zx-headless -- run the ZX Spectrum emulator without display and audio\n\n");
+                fprintf(stderr, "%s", getopt_create_help_string(&ctx, help_buf, sizeof(help_buf)));
+                return 0;
+            case 'f':
+                file_path = ctx.current_opt_arg;
+                break;
+            case 't':
+                if (0 == strcmp(ctx.current_opt_arg, "zx48k")) {
+                    type = ZX_TYPE_48K;
+                }
+                else if (0 != strcmp(ctx.current_opt_arg, "zx128")) {
+                    fprintf(stderr, "unknown machine type %s (expected zx48k or zx128)\n", ctx.current_opt_arg);
+                    return 10;
+                }
+                break;
+            case 'i':
+                input = ctx.current_opt_arg;
+                break;
+            case 's':
+                save_state_path = ctx.current_opt_arg;
+                break;
+            case 'l':
+                load_state_path = ctx.current_opt_arg;
+                break;
+            case 'm':
+                movie_path = ctx.current_opt_arg;
+                break;
+            case 'r':
+                record_movie_path = ctx.current_opt_arg;
+                break;
+            case 'c':
+                capture_path = ctx.current_opt_arg;
+                break;
+            case 'a':
+                capture_audio_path = ctx.current_opt_arg;
+                break;
+            case 'F':
+                if (0 == strcmp(ctx.current_opt_arg, "rgba")) {
+                    capture_format = CAPTURE_FORMAT_RAW;
+                }
+                else if (0 != strcmp(ctx.current_opt_arg, "y4m")) {
+                    fprintf(stderr, "unknown capture format %s (expected y4m or rgba)\n", ctx.current_opt_arg);
+                    return 10;
+                }
+                break;
+            case 'n':
+                num_frames = atoi(ctx.current_opt_arg);
+                break;
+            default:
+                break;
+        }
+    }
+    if (num_frames <= 0) {
+        fprintf(stderr, "number of frames must be > 0 (--frames, -n)\n");
+        return 10;
+    }
+    if (capture_audio_path && !capture_path) {
+        fprintf(stderr, "--capture-audio needs a video capture (--capture, -c)\n");
+        return 10;
+    }
+    // keep stdout clean when the capture is streamed to it
+    const bool capture_to_stdout = (capture_path && (0 == strcmp(capture_path, "-"))) ||
+                                   (capture_audio_path && (0 == strcmp(capture_audio_path, "-")));
+    FILE* report = capture_to_stdout ? stderr : stdout;
+
+    stm_setup();
+    if (movie_path) {
+        file_path = 0;
+        input = 0;
+    }
+    if (!zxrun_init(&run, &(zxrun_desc_t){
+        .type = type,
+        .file_path = file_path,
+        .input = input,
+        .record_movie = (0 != record_movie_path),
+        .audio = { .func = capture_audio_path ? capture_push_audio : 0 },
+        // frames are captured when the emulator finishes a video frame, not per 20 ms run frame
+        .video = { .func = capture_path ? capture_push_video : 0 },
+    })) {
+        return 10;
+    }
+    if (movie_path && !zxrun_play_movie(&run, movie_path)) {
+        return 10;
+    }
+    if (load_state_path && !zxrun_load_state(&run, load_state_path)) {
+        return 10;
+    }
+    if (capture_path) {
+        if (!capture_init(&(capture_desc_t){
+            .video_path = capture_path,
+            .audio_path = capture_audio_path,
+            .format = capture_format,
+            .width = zx_display_width(&run.zx),
+            .height = zx_display_height(&run.zx),
+            // one frame per emulated video frame, which isn't exactly 50 Hz
+            .fps = (int) run.zx.freq_hz,
+            .fps_den = (int) zx_frame_ticks(run.zx.type),
+            .sample_rate = ZXRUN_SAMPLE_RATE,
+            // not real-time, so wait for the writer instead of dropping frames
+            .wait = true,
+        })) {
+            return 10;
+        }
+    }
+    const uint64_t start_time = stm_now();
+    for (int frame = 0; frame < num_frames; frame++) {
+        if (!zxrun_frame(&run)) {
+            return 10;
+        }
+    }
+    const double run_time_s = stm_sec(stm_since(start_time));
+
+    fprintf(report, "frames: %d, ticks: %llu, audio samples: %llu, time: %.3fs, emulated: %.2f MHz (%.1f frames/sec)\n",
+        num_frames,
+        (unsigned long long)run.num_ticks,
+        (unsigned long long)run.num_audio_samples,
+        run_time_s,
+        (run_time_s > 0.0) ? ((double)run.num_ticks / run_time_s) / 1000000.0 : 0.0,
+        (run_time_s > 0.0) ? (double)num_frames / run_time_s : 0.0);
+
+    if (movie_path) {
+        fprintf(report, "movie: %s, framebuffer hash: %016llX\n",
+            run.movie.desync ? "DESYNC" : (run.movie.playing ? "playing" : "finished"),
+            (unsigned long long)zxrun_framebuffer_hash(&run));
+    }
+    if (capture_path) {
+        const capture_stats_t cap_stats = capture_stats();
+        capture_shutdown();
+        fprintf(report, "captured %llu frames (%llu dropped), %llu audio samples\n",
+            (unsigned long long)cap_stats.frames,
+            (unsigned long long)cap_stats.dropped_frames,
+            (unsigned long long)cap_stats.samples);
+    }
+    if (save_state_path && !zxrun_save_state(&run, save_state_path)) {
+        return 10;
+    }
+    if (record_movie_path && !zxrun_save_movie(&run, record_movie_path)) {
+        return 10;
+    }
+    zxrun_discard(&run);
+    return 0;
+}
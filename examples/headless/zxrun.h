@@ -0,0 +1,377 @@
+#pragma once
+/*
+    zxrun.h -- a self-contained ZX Spectrum instance for the headless runners
+
+    Bundles a zx_t with its own in-memory framebuffer, null audio sink,
+    keyboard playback buffer and optionally a file to load, so that any
+    number of instances can be run side by side (and on different threads).
+
+    Include after systems/zx.h, zxstate.h, zxmovie.h, zxframe.h and keybuf.h, the implementation is compiled
+    when COMMON_IMPL is defined.
+*/
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// emulated time per frame in microseconds (50 Hz PAL frames)
+#define ZXRUN_FRAME_TIME_US (20000)
+// number of frames to run after power-on before a file is loaded (same as zx.c)
+#define ZXRUN_LOAD_DELAY_FRAMES (100)
+// max size of a file to load
+#define ZXRUN_MAX_FILE_SIZE (1024 * 1024)
+// audio sample rate of the null audio sink
+#define ZXRUN_SAMPLE_RATE (44100)
+
+// receives the framebuffer of each finished video frame
+typedef struct {
+    void (*func)(const uint32_t* pixels, int width, int height, void* user_data);
+    void* user_data;
+} zxrun_video_callback_t;
+
+typedef struct {
+    zx_type_t type;
+    const char* file_path;  // optional .z80, .txt or .bas file to load
+    const char* input;      // optional keyboard input, typed after the file is loaded
+    bool record_movie;      // record the keyboard input into a movie, starting after the file is loaded
+    chips_audio_callback_t audio;   // optional, receives the generated audio samples
+    zxrun_video_callback_t video;   // optional, receives each finished video frame
+} zxrun_desc_t;
+
+typedef struct {
+    zx_t zx;
+    keybuf_t keybuf;
+    uint32_t* pixels;
+    size_t pixels_size;
+    const char* file_path;
+    const char* input;
+    uint8_t* file_data;
+    int file_size;
+    int frame_count;
+    uint64_t num_ticks;
+    uint64_t num_audio_samples;
+    bool record_movie;
+    zx_movie_t movie;
+    chips_audio_callback_t audio;
+    zxrun_video_callback_t video;
+    uint32_t movie_ticks;   // T-states of movie slices not yet passed on as video frames
+} zxrun_t;
+
+/* initialize an instance, returns false if the file couldn't be loaded */
+bool zxrun_init(zxrun_t* run, const zxrun_desc_t* desc);
+/* release the instance's resources */
+void zxrun_discard(zxrun_t* run);
+/* run one frame, returns false if loading the file into the emulator failed */
+bool zxrun_frame(zxrun_t* run);
+/* write the emulator state to a save-state file */
+bool zxrun_save_state(const zxrun_t* run, const char* path);
+/* restore the emulator state from a save-state file */
+bool zxrun_load_state(zxrun_t* run, const char* path);
+/* start playback of a movie file, replaces file loading and keyboard input */
+bool zxrun_play_movie(zxrun_t* run, const char* path);
+/* write the recorded movie to a file */
+bool zxrun_save_movie(const zxrun_t* run, const char* path);
+/* FNV-1a hash over the visible framebuffer content */
+uint64_t zxrun_framebuffer_hash(const zxrun_t* run);
+/* 64-bit perceptual hash of the framebuffer (similar images have a small bit distance) */
+uint64_t zxrun_framebuffer_phash(const zxrun_t* run);
+/* number of differing bits between two perceptual hashes */
+int zxrun_phash_distance(uint64_t a, uint64_t b);
+
+/*== IMPLEMENTATION ==========================================================*/
+#ifdef COMMON_IMPL
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <assert.h>
+
+// null audio sink, counts the generated samples and forwards them to the optional user callback
+static void _zxrun_push_audio(const float* samples, int num_samples, void* user_data) {
+    zxrun_t* run = (zxrun_t*) user_data;
+    run->num_audio_samples += (uint64_t)num_samples;
+    if (run->audio.func) {
+        run->audio.func(samples, num_samples, run->audio.user_data);
+    }
+}
+
+// load a file into a malloc'ed, zero-terminated buffer
+static bool _zxrun_load_file(zxrun_t* run, const char* path) {
+    FILE* fp = fopen(path, "rb");
+    if (!fp) {
+        fprintf(stderr, "failed to open file '%s'\n", path);
+        return false;
+    }
+    run->file_data = (uint8_t*) malloc(ZXRUN_MAX_FILE_SIZE + 1);
+    run->file_size = (int)fread(run->file_data, 1, ZXRUN_MAX_FILE_SIZE, fp);
+    fclose(fp);
+    if (run->file_size <= 0) {
+        fprintf(stderr, "failed to read file '%s'\n", path);
+        return false;
+    }
+    // in case it's a text file, zero-terminate the data
+    run->file_data[run->file_size] = 0;
+    return true;
+}
+
+static bool _zxrun_has_ext(const char* path, const char* ext) {
+    const char* dot = strrchr(path, '.');
+    if (!dot) {
+        return false;
+    }
+    dot++;
+    while (*dot && *ext) {
+        if (tolower(*dot++) != *ext++) {
+            return false;
+        }
+    }
+    return (*dot == 0) && (*ext == 0);
+}
+
+bool zxrun_init(zxrun_t* run, const zxrun_desc_t* desc) {
+    assert(run && desc);
+    memset(run, 0, sizeof(zxrun_t));
+    run->file_path = desc->file_path;
+    run->input = desc->input;
+    run->record_movie = desc->record_movie;
+    run->audio = desc->audio;
+    run->video = desc->video;
+    if (run->file_path && !_zxrun_load_file(run, run->file_path)) {
+        return false;
+    }
+    keybuf_instance_init(&run->keybuf, &(keybuf_desc_t){ .key_delay_frames=6 });
+    run->pixels_size = (size_t)(zx_std_display_width() * zx_std_display_height()) * sizeof(uint32_t);
+    run->pixels = (uint32_t*) calloc(1, run->pixels_size);
+    zx_init(&run->zx, &(zx_desc_t){
+        .type = desc->type,
+        .pixel_buffer = { .ptr=run->pixels, .size=run->pixels_size },
+        .audio = {
+            .callback = { .func=_zxrun_push_audio, .user_data=run },
+            .sample_rate = ZXRUN_SAMPLE_RATE,
+        },
+        .roms = {
+            .zx48k = { .ptr=dump_amstrad_zx48k_bin, .size=sizeof(dump_amstrad_zx48k_bin) },
+            .zx128_0 = { .ptr=dump_amstrad_zx128k_0_bin, .size=sizeof(dump_amstrad_zx128k_0_bin) },
+            .zx128_1 = { .ptr=dump_amstrad_zx128k_1_bin, .size=sizeof(dump_amstrad_zx128k_1_bin) },
+        },
+    });
+    if (!run->file_path) {
+        if (run->record_movie) {
+            zx_movie_record(&run->movie, &run->zx);
+        }
+        if (run->input) {
+            keybuf_instance_put(&run->keybuf, run->input);
+        }
+    }
+    return true;
+}
+
+void zxrun_discard(zxrun_t* run) {
+    assert(run);
+    if (run->pixels) {
+        zx_discard(&run->zx);
+    }
+    zx_movie_discard(&run->movie);
+    free(run->pixels);
+    free(run->file_data);
+    run->pixels = 0;
+    run->file_data = 0;
+}
+
+static void _zxrun_video_frame(zx_t* sys, void* user_data) {
+    zxrun_t* run = (zxrun_t*) user_data;
+    run->video.func(run->pixels, zx_display_width(sys), zx_display_height(sys), run->video.user_data);
+}
+
+// the movie slices can't be split at the video frame ends, so pass on as
+// many frames as the emulated time covers at the end of the slice
+static uint32_t _zxrun_exec_movie(zxrun_t* run) {
+    const uint32_t ticks = zx_movie_exec_frame(&run->movie, &run->zx);
+    if (run->video.func) {
+        run->movie_ticks += ticks;
+        while (run->movie_ticks >= zx_frame_ticks(run->zx.type)) {
+            run->movie_ticks -= zx_frame_ticks(run->zx.type);
+            _zxrun_video_frame(&run->zx, run);
+        }
+    }
+    return ticks;
+}
+
+bool zxrun_frame(zxrun_t* run) {
+    assert(run && run->pixels);
+    if (run->movie.playing) {
+        run->num_ticks += _zxrun_exec_movie(run);
+        run->frame_count++;
+        return true;
+    }
+    if (run->movie.recording) {
+        run->num_ticks += _zxrun_exec_movie(run);
+    }
+    else if (run->video.func) {
+        run->num_ticks += zx_exec_frames(&run->zx, ZXRUN_FRAME_TIME_US, _zxrun_video_frame, run);
+    }
+    else {
+        run->num_ticks += zx_exec(&run->zx, ZXRUN_FRAME_TIME_US);
+    }
+    if (run->file_data && (run->frame_count == ZXRUN_LOAD_DELAY_FRAMES)) {
+        if (_zxrun_has_ext(run->file_path, "txt") || _zxrun_has_ext(run->file_path, "bas")) {
+            keybuf_instance_put(&run->keybuf, (const char*)run->file_data);
+        }
+        else if (!zx_quickload(&run->zx, run->file_data, run->file_size)) {
+            fprintf(stderr, "failed to load file '%s'\n", run->file_path);
+            return false;
+        }
+        if (run->record_movie) {
+            zx_movie_record(&run->movie, &run->zx);
+        }
+        if (run->input) {
+            keybuf_instance_put(&run->keybuf, run->input);
+        }
+    }
+    uint8_t key_code;
+    if (0 != (key_code = keybuf_instance_get(&run->keybuf, ZXRUN_FRAME_TIME_US))) {
+        zx_movie_key_down(&run->movie, &run->zx, key_code);
+        zx_movie_key_up(&run->movie, &run->zx, key_code);
+    }
+    run->frame_count++;
+    return true;
+}
+
+bool zxrun_save_state(const zxrun_t* run, const char* path) {
+    assert(run && run->pixels && path);
+    const size_t size = zx_state_size();
+    void* buf = malloc(size);
+    assert(buf);
+    bool success = zx_save_state(&run->zx, buf, size);
+    FILE* fp = fopen(path, "wb");
+    if (fp) {
+        success &= (size == fwrite(buf, 1, size, fp));
+        fclose(fp);
+    }
+    else {
+        success = false;
+    }
+    free(buf);
+    if (!success) {
+        fprintf(stderr, "failed to write save-state '%s'\n", path);
+    }
+    return success;
+}
+
+bool zxrun_load_state(zxrun_t* run, const char* path) {
+    assert(run && run->pixels && path);
+    const size_t size = zx_state_size();
+    void* buf = malloc(size);
+    assert(buf);
+    bool success = false;
+    FILE* fp = fopen(path, "rb");
+    if (fp) {
+        success = (size == fread(buf, 1, size, fp)) && zx_load_state(&run->zx, buf, size);
+        fclose(fp);
+    }
+    free(buf);
+    if (!success) {
+        fprintf(stderr, "failed to load save-state '%s' (missing file or incompatible version)\n", path);
+    }
+    return success;
+}
+
+bool zxrun_play_movie(zxrun_t* run, const char* path) {
+    assert(run && run->pixels && path);
+    bool success = false;
+    FILE* fp = fopen(path, "rb");
+    if (fp) {
+        fseek(fp, 0, SEEK_END);
+        const long size = ftell(fp);
+        fseek(fp, 0, SEEK_SET);
+        if (size > 0) {
+            void* buf = malloc((size_t)size);
+            assert(buf);
+            success = ((size_t)size == fread(buf, 1, (size_t)size, fp)) && zx_movie_play(&run->movie, &run->zx, buf, (size_t)size);
+            free(buf);
+        }
+        fclose(fp);
+    }
+    if (!success) {
+        fprintf(stderr, "failed to load movie '%s' (missing file or incompatible version)\n", path);
+    }
+    return success;
+}
+
+bool zxrun_save_movie(const zxrun_t* run, const char* path) {
+    assert(run && path);
+    const size_t size = zx_movie_data_size(&run->movie);
+    void* buf = malloc(size);
+    assert(buf);
+    bool success = zx_movie_save(&run->movie, buf, size);
+    FILE* fp = fopen(path, "wb");
+    if (fp) {
+        success &= (size == fwrite(buf, 1, size, fp));
+        fclose(fp);
+    }
+    else {
+        success = false;
+    }
+    free(buf);
+    if (!success) {
+        fprintf(stderr, "failed to write movie '%s'\n", path);
+    }
+    return success;
+}
+
+uint64_t zxrun_framebuffer_hash(const zxrun_t* run) {
+    assert(run && run->pixels);
+    const uint8_t* ptr = (const uint8_t*) run->pixels;
+    uint64_t hash = 0xCBF29CE484222325ULL;
+    for (size_t i = 0; i < run->pixels_size; i++) {
+        hash ^= ptr[i];
+        hash *= 0x100000001B3ULL;
+    }
+    return hash;
+}
+
+/* difference hash: the framebuffer luminance is box-filtered down to 9x8
+   cells, each bit tells whether a cell is darker than its right neighbour,
+   so the hash survives small changes like a blinking cursor or a sprite
+   moved by a pixel, but not a different screen
+*/
+uint64_t zxrun_framebuffer_phash(const zxrun_t* run) {
+    assert(run && run->pixels);
+    const int width = zx_std_display_width();
+    const int height = zx_std_display_height();
+    uint32_t lum[8][9];
+    for (int cy = 0; cy < 8; cy++) {
+        const int y0 = (cy * height) / 8;
+        const int y1 = ((cy + 1) * height) / 8;
+        for (int cx = 0; cx < 9; cx++) {
+            const int x0 = (cx * width) / 9;
+            const int x1 = ((cx + 1) * width) / 9;
+            uint32_t sum = 0;
+            for (int y = y0; y < y1; y++) {
+                const uint32_t* src = run->pixels + y * width;
+                for (int x = x0; x < x1; x++) {
+                    const uint32_t c = src[x];
+                    sum += 77 * (c & 0xFF) + 150 * ((c >> 8) & 0xFF) + 29 * ((c >> 16) & 0xFF);
+                }
+            }
+            lum[cy][cx] = sum / (uint32_t)((x1 - x0) * (y1 - y0));
+        }
+    }
+    uint64_t hash = 0;
+    for (int cy = 0; cy < 8; cy++) {
+        for (int cx = 0; cx < 8; cx++) {
+            hash = (hash << 1) | ((lum[cy][cx] < lum[cy][cx + 1]) ? 1 : 0);
+        }
+    }
+    return hash;
+}
+
+int zxrun_phash_distance(uint64_t a, uint64_t b) {
+    uint64_t x = a ^ b;
+    int num_bits = 0;
+    while (x) {
+        x &= x - 1;
+        num_bits++;
+    }
+    return num_bits;
+}
+#endif /* COMMON_IMPL */
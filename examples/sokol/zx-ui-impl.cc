@@ -12,6 +12,7 @@
 #define UI_DBG_USE_Z80
 #define CHIPS_UTIL_IMPL
 #include "util/z80dasm.h"
+#include "z80prof.h"
 #define CHIPS_UI_IMPL
 #include "imgui.h"
 #include "ui/ui_util.h"
@@ -25,3 +26,4 @@
 #include "ui/ui_ay38910.h"
 #include "ui/ui_audio.h"
 #include "ui/ui_zx.h"
+#include "ui_z80prof.h"
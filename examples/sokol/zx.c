@@ -6,6 +6,10 @@
     - no tape or disc emulation
 */
 #include "common.h"
+#include <stdio.h>  // printf
+#include <stdlib.h> // malloc, qsort, exit
+#include <string.h> // memcpy
+#include <assert.h>
 #define CHIPS_IMPL
 #include "chips/z80.h"
 #include "chips/beeper.h"
@@ -15,6 +19,15 @@
 #include "chips/mem.h"
 #include "systems/zx.h"
 #include "zx-roms.h"
+#include "zxstate.h"
+#include "zxmovie.h"
+#include "zxframe.h"
+#if !defined(CHIPS_USE_UI)
+    // the UI build compiles the disassembler in zx-ui-impl.cc
+    #define CHIPS_UTIL_IMPL
+#endif
+#include "util/z80dasm.h"
+#include "z80prof.h"
 #if defined(CHIPS_USE_UI)
     #define UI_DBG_USE_Z80
     #include "ui.h"
@@ -28,15 +41,92 @@
     #include "ui/ui_ay38910.h"
     #include "ui/ui_audio.h"
     #include "ui/ui_zx.h"
+    #include "ui_z80prof.h"
 #endif
 
+// an additional emulator instance displayed as a tile (tiles=N)
+typedef struct {
+    int index;
+    zx_t zx;
+    thread_t thread;
+    uint8_t* file_data;     // optional snapshot to load after booting (tileN=path)
+    int file_size;
+} tile_t;
+
+// the inputs of the GPU screen decoder (decode=gpu) for one frame
+typedef struct {
+    uint8_t vram[GFX_ZX_VRAM_SIZE];
+    uint8_t border_lines[GFX_ZX_MAX_LINES];
+    int num_lines;
+    bool flash;
+} zx_screen_t;
+
 static struct {
     zx_t zx;
     uint32_t frame_time_us;
     uint32_t ticks;
     double emu_time_ms;
+    bool prof_overlay;      // show the profiler zones (toggle with F3)
+    const char* trace_path; // Chrome trace-event export (trace=path.json, written with F4 and on exit)
+    struct {
+        uint64_t start;     // start of the current reporting window
+        prof_stats_t emu;   // statistics of the last complete window
+        prof_stats_t upload;
+        int num_zones;
+        prof_zone_stats_t zones[PROF_MAX_ZONES];
+    } prof_window;
+    struct {
+        int num_frames;     // number of frames to run in benchmark mode (0: disabled)
+    } bench;
+    struct {
+        int num_frames;     // number of frames to run ahead (runahead=N, 0: disabled)
+        bool active;        // currently running ahead, audio output is discarded
+        double time_ms;     // host time spent on the last run-ahead
+        zx_t snapshot;      // emulator state to restore after running ahead
+        zx_screen_t screen; // screen of the run-ahead frame for the GPU decoder
+    } runahead;
+    struct {
+        bool enabled;       // rewind buffer is active (disable with rewind=false)
+        volatile int active;    // F1 is held down, run backward in time
+        uint32_t time_us;   // emulated time since the last capture or pop
+    } rewind;
+    struct {
+        zx_movie_t movie;   // input recording (record=path) or playback (movie=path)
+        const char* record_path;
+        uint32_t time_us;   // emulated time not yet run in fixed movie slices
+    } movie;
+    struct {
+        uint32_t ticks;     // emulated T-states not yet covered by a captured frame (movie slices)
+    } capture;
+    struct {
+        z80prof_t prof;     // guest hot-spot profiler (z80prof=path.csv, z80prof_folded=path, F2 in the UI)
+        const char* csv_path;   // written on exit when started with z80prof=path.csv
+        const char* folded_path;    // call tree as folded stacks, written on exit
+    } z80prof;
+    struct {
+        bool enabled;       // throttle while hidden, unfocused or stopped (disable with idle=false)
+        bool hidden;        // window is minimized or the app is suspended
+        bool unfocused;     // window doesn't have the input focus
+        uint64_t last_input_time;
+        uint64_t last_sound_time;
+        uint64_t last_present_time;
+        volatile int sound;     // set by push_audio() when a non-silent sample was generated
+        volatile int paused;    // emulation is paused (read by the emulator thread)
+    } idle;
+    struct {
+        int num;            // number of emulator instances shown side by side, including state.zx
+        tile_t* items[GFX_MAX_TILES];   // the additional instances, items[0] is unused
+        volatile int quit;
+    } tiles;
+    struct {
+        bool enabled;       // emulator runs on its own thread (thread=true)
+        thread_t thread;
+        thread_mutex_t lock;
+        volatile int quit;
+    } emu_thread;
     #if defined(CHIPS_USE_UI)
         ui_zx_t ui_zx;
+        ui_z80prof_t ui_z80prof;
     #endif
 } state;
 
@@ -47,12 +137,104 @@ static struct {
 #endif
 #define BORDER_LEFT (8)
 #define BORDER_RIGHT (8)
-#define BORDER_BOTTOM (16)
+#define BORDER_BOTTOM (32)
+
+// fixed emulated time slice per frame in benchmark mode
+#define BENCH_FRAME_TIME_US (20000)
+// target duration of one exec slice on the emulator thread
+#define EMU_THREAD_SLICE_US (10000)
+// max number of frames to run ahead, and duration of one emulated video frame
+#define RUNAHEAD_MAX_FRAMES (8)
+#define ZX_FRAME_TIME_US (20000)
+// top-left corner of the 256x192 screen area in the emulator display
+#define ZX_SCREEN_X (32)
+#define ZX_SCREEN_Y (32)
+// idle mode: present at a low rate while unfocused or stopped in the debugger
+// (every frame is still drawn, the frames are just further apart), stop
+// presenting while hidden, and pause emulation unless sound is playing
+#define IDLE_PRESENT_INTERVAL_MS (100.0)
+#define IDLE_INPUT_TIMEOUT_MS (1000.0)
+#define IDLE_SOUND_TIMEOUT_MS (2000.0)
+#define IDLE_SLEEP_US (20000)
+// rewind history: one capture per emulated frame, a keyframe per second, 60 seconds
+#define REWIND_KEYFRAME_INTERVAL (50)
+#define REWIND_MAX_FRAMES (50 * 60)
+// emulated time after which the additional tiles load their snapshot
+#define TILE_LOAD_DELAY_US (2000000)
+// duration of one profiler reporting window in the status bar
+#define PROF_WINDOW_MS (1000.0)
+// number of zone calls per thread kept for the trace=path.json export
+#define PROF_TRACE_EVENTS (1<<16)
+
+// the ZX colors as written by the emulator into the framebuffer (ABGR),
+// used for the 8-bit indexed texture upload path in gfx.h
+static const uint32_t zx_palette[16] = {
+    0xFF000000,     // std black
+    0xFFD70000,     // std blue
+    0xFF0000D7,     // std red
+    0xFFD700D7,     // std magenta
+    0xFF00D700,     // std green
+    0xFFD7D700,     // std cyan
+    0xFF00D7D7,     // std yellow
+    0xFFD7D7D7,     // std white
+    0xFF000000,     // bright black
+    0xFFFF0000,     // bright blue
+    0xFF0000FF,     // bright red
+    0xFFFF00FF,     // bright magenta
+    0xFF00FF00,     // bright green
+    0xFFFFFF00,     // bright cyan
+    0xFF00FFFF,     // bright yellow
+    0xFFFFFFFF,     // bright white
+};
+
+// lock access to the emulator state while it runs on its own thread
+static void emu_lock(void) {
+    if (state.emu_thread.enabled) {
+        thread_mutex_lock(state.emu_thread.lock);
+    }
+}
+
+static void emu_unlock(void) {
+    if (state.emu_thread.enabled) {
+        thread_mutex_unlock(state.emu_thread.lock);
+    }
+}
+
+// forward keyboard input to the emulator through the movie recorder
+static void key_down(int key_code) {
+    zx_movie_key_down(&state.movie.movie, &state.zx, key_code);
+}
+
+static void key_up(int key_code) {
+    zx_movie_key_up(&state.movie.movie, &state.zx, key_code);
+}
 
 // audio-streaming callback
 static void push_audio(const float* samples, int num_samples, void* user_data) {
     (void)user_data;
-    saudio_push(samples, num_samples);
+    if (!state.runahead.active && !thread_atomic_load(&state.rewind.active)) {
+        prof_begin("audio_push");
+        audio_push(samples, num_samples);
+        prof_end();
+        if (capture_isvalid()) {
+            capture_audio(samples, num_samples);
+        }
+        // remember that sound is playing, so that idle mode keeps the emulation running
+        if (state.idle.enabled && (0 == thread_atomic_load(&state.idle.sound))) {
+            for (int i = 0; i < num_samples; i++) {
+                if ((samples[i] > 0.001f) || (samples[i] < -0.001f)) {
+                    thread_atomic_store(&state.idle.sound, 1);
+                    break;
+                }
+            }
+        }
+    }
+}
+
+// memory read callback for the Z80 profiler's disassembly
+static uint8_t z80prof_read(uint16_t addr, void* user_data) {
+    zx_t* sys = (zx_t*) user_data;
+    return mem_rd(&sys->mem, addr);
 }
 
 // get zx_desc_t struct for given ZX type and joystick type
@@ -63,7 +245,7 @@ zx_desc_t zx_desc(zx_type_t type, zx_joystick_type_t joy_type) {
         .pixel_buffer = { .ptr=gfx_framebuffer(), .size=gfx_framebuffer_size() },
         .audio = {
             .callback = { .func=push_audio },
-            .sample_rate = saudio_sample_rate(),
+            .sample_rate = audio_sample_rate(),
         },
         .roms = {
             .zx48k = { .ptr=dump_amstrad_zx48k_bin, .size=sizeof(dump_amstrad_zx48k_bin) },
@@ -78,15 +260,49 @@ zx_desc_t zx_desc(zx_type_t type, zx_joystick_type_t joy_type) {
 
 #if defined(CHIPS_USE_UI)
 void ui_draw_cb(void) {
+    // the emulator never runs on its own thread in the UI build (see app_init())
     ui_zx_draw(&state.ui_zx);
+    ui_z80prof_draw(&state.ui_z80prof);
 }
 static void ui_boot_cb(zx_t* sys, zx_type_t type) {
+    // zx_init() resets the debug hooks, the profiler needs to be installed again
+    const bool profiling = state.z80prof.prof.enabled;
+    z80prof_disable(&state.z80prof.prof, &sys->debug);
     zx_desc_t desc = zx_desc(type, sys->joystick_type);
     zx_init(sys, &desc);
+    state.z80prof.prof.frame_ticks = zx_frame_ticks(type);
+    if (profiling) {
+        z80prof_enable(&state.z80prof.prof, &sys->debug);
+    }
 }
 #endif
 
+static void emu_thread_func(void* arg);
+static uint32_t emu_exec(uint32_t micro_seconds);
+static void init_tiles(zx_type_t type, zx_joystick_type_t joy_type);
+static void discard_tiles(void);
+
 void app_init(void) {
+    if (sargs_exists("bench")) {
+        state.bench.num_frames = atoi(sargs_value("bench"));
+    }
+    #if !defined(__EMSCRIPTEN__)
+    // the debugger reads and modifies the emulator state in place from within
+    // ui_zx_draw() (memory editors, breakpoints, stepping), so the UI build
+    // keeps the emulator on the main thread
+    #if !defined(CHIPS_USE_UI)
+    state.emu_thread.enabled = sargs_equals("thread", "true") && (state.bench.num_frames <= 0);
+    #endif
+    if (sargs_exists("tiles") && (state.bench.num_frames <= 0)) {
+        state.tiles.num = atoi(sargs_value("tiles"));
+        if (state.tiles.num > GFX_MAX_TILES) {
+            state.tiles.num = GFX_MAX_TILES;
+        }
+    }
+    #endif
+    if (state.tiles.num < 1) {
+        state.tiles.num = 1;
+    }
     gfx_init(&(gfx_desc_t){
         #ifdef CHIPS_USE_UI
         .draw_extra_cb = ui_draw,
@@ -95,11 +311,26 @@ void app_init(void) {
         .border_right = BORDER_RIGHT,
         .border_top = BORDER_TOP,
         .border_bottom = BORDER_BOTTOM,
+        .triple_buffer = state.emu_thread.enabled,
+        .palette = sargs_equals("indexed", "false") ? 0 : zx_palette,
+        .palette_size = 16,
+        .zx_decode = sargs_equals("decode", "gpu"),
+        .two_pass = sargs_equals("twopass", "true"),
+        .max_fb_width = zx_std_display_width(),
+        .max_fb_height = zx_std_display_height(),
+        .num_tiles = state.tiles.num,
     });
     keybuf_init(&(keybuf_desc_t){ .key_delay_frames=6 });
     clock_init();
     prof_init();
-    saudio_setup(&(saudio_desc){0});
+    prof_trace_thread_name("main");
+    if (sargs_exists("trace")) {
+        state.trace_path = sargs_value("trace");
+        prof_trace_start(PROF_TRACE_EVENTS);
+    }
+    audio_init(&(audio_desc_t){
+        .pull_mode = sargs_equals("audio", "pull"),
+    });
     fs_init();
     zx_type_t type = ZX_TYPE_128;
     if (sargs_exists("type")) {
@@ -121,6 +352,7 @@ void app_init(void) {
     }
     zx_desc_t desc = zx_desc(type, joy_type);
     zx_init(&state.zx, &desc);
+    init_tiles(type, joy_type);
     #ifdef CHIPS_USE_UI
         ui_init(ui_draw_cb);
         ui_zx_init(&state.ui_zx, &(ui_zx_desc_t){
@@ -139,35 +371,232 @@ void app_init(void) {
             }
         });
     #endif
+    z80prof_init(&state.z80prof.prof, &(z80prof_desc_t){
+        .cpu = &state.zx.cpu,
+        .read_cb = z80prof_read,
+        .user_data = &state.zx,
+        .frame_ticks = zx_frame_ticks(type),
+    });
+    if (sargs_exists("z80prof")) {
+        state.z80prof.csv_path = sargs_value("z80prof");
+    }
+    if (sargs_exists("z80prof_folded")) {
+        state.z80prof.folded_path = sargs_value("z80prof_folded");
+    }
+    if (state.z80prof.csv_path || state.z80prof.folded_path) {
+        z80prof_enable(&state.z80prof.prof, &state.zx.debug);
+    }
+    #ifdef CHIPS_USE_UI
+        ui_z80prof_init(&state.ui_z80prof, &(ui_z80prof_desc_t){
+            .title = "Z80 Profiler (F2)",
+            .prof = &state.z80prof.prof,
+            .debug = &state.zx.debug,
+            .csv_path = state.z80prof.csv_path ? state.z80prof.csv_path : "z80prof.csv",
+            .folded_path = state.z80prof.folded_path ? state.z80prof.folded_path : "z80prof.folded",
+            .x = 40,
+            .y = 40,
+            .open = state.z80prof.prof.enabled,
+        });
+    #endif
     
     bool delay_input = false;
-    if (sargs_exists("file")) {
+    if (sargs_exists("movie")) {
+        // movie playback replaces file loading and keyboard input
+        delay_input = true;
+        fs_start_load_file(sargs_value("movie"));
+    }
+    else if (sargs_exists("file")) {
         delay_input = true;
         fs_start_load_file(sargs_value("file"));
     }
+    #if !defined(__EMSCRIPTEN__)
+    if (sargs_exists("record")) {
+        state.movie.record_path = sargs_value("record");
+        // when a file is loaded, the recording starts after loading
+        if (!delay_input) {
+            zx_movie_record(&state.movie.movie, &state.zx);
+        }
+    }
+    #endif
     if (!delay_input) {
         if (sargs_exists("input")) {
             keybuf_put(sargs_value("input"));
         }
     }
+    if (state.bench.num_frames > 0) {
+        clock_set_fixed_frame_time(BENCH_FRAME_TIME_US);
+    }
+    if (sargs_exists("runahead")) {
+        state.runahead.num_frames = atoi(sargs_value("runahead"));
+        if (state.runahead.num_frames < 0) {
+            state.runahead.num_frames = 0;
+        }
+        else if (state.runahead.num_frames > RUNAHEAD_MAX_FRAMES) {
+            state.runahead.num_frames = RUNAHEAD_MAX_FRAMES;
+        }
+    }
+    #if !defined(__EMSCRIPTEN__)
+    state.rewind.enabled = !sargs_equals("rewind", "false") && (state.bench.num_frames <= 0);
+    #endif
+    if (state.rewind.enabled) {
+        rewind_init(&(rewind_desc_t){
+            .state_size = sizeof(zx_t),
+            .max_frames = REWIND_MAX_FRAMES,
+            .keyframe_interval = REWIND_KEYFRAME_INTERVAL,
+        });
+    }
+    state.idle.enabled = !sargs_equals("idle", "false") && (state.bench.num_frames <= 0);
+    #if !defined(__EMSCRIPTEN__)
+    if (sargs_exists("capture")) {
+        // raw RGBA frames for .rgba or .raw files, otherwise a Y4M stream
+        const char* path = sargs_value("capture");
+        const char* ext = strrchr(path, '.');
+        const bool raw = ext && ((0 == strcmp(ext, ".rgba")) || (0 == strcmp(ext, ".raw")));
+        capture_init(&(capture_desc_t){
+            .video_path = path,
+            .audio_path = sargs_exists("capture_audio") ? sargs_value("capture_audio") : 0,
+            .format = raw ? CAPTURE_FORMAT_RAW : CAPTURE_FORMAT_Y4M,
+            .width = zx_std_display_width(),
+            .height = zx_std_display_height(),
+            // frames are captured once per emulated video frame, which isn't exactly 50 Hz
+            .fps = (int) state.zx.freq_hz,
+            .fps_den = (int) zx_frame_ticks(state.zx.type),
+            .sample_rate = audio_sample_rate(),
+        });
+    }
+    #endif
+    if (state.emu_thread.enabled) {
+        state.emu_thread.lock = thread_mutex_create();
+        state.emu_thread.thread = thread_start(emu_thread_func, 0);
+        if (!state.emu_thread.thread.handle) {
+            thread_mutex_destroy(state.emu_thread.lock);
+            state.emu_thread.enabled = false;
+        }
+    }
 }
 
 static void handle_file_loading(void);
 static void send_keybuf_input(void);
+static void save_movie(const char* path);
+static void write_trace(void);
 static void draw_status_bar(void);
+static void run_benchmark(void);
+static void grab_zx_screen(zx_screen_t* screen);
+static void update_zx_screen(void);
+
+typedef enum {
+    IDLE_NONE,      // run and present at full rate
+    IDLE_THROTTLE,  // present at a low rate
+    IDLE_STOP,      // don't present at all
+} idle_mode_t;
+
+// check whether the emulator window is idle, and whether emulation should continue
+static idle_mode_t idle_mode(bool* out_run_emu) {
+    *out_run_emu = true;
+    if (!state.idle.enabled) {
+        return IDLE_NONE;
+    }
+    const uint64_t now = stm_now();
+    if (thread_atomic_exchange(&state.idle.sound, 0)) {
+        state.idle.last_sound_time = now;
+    }
+    // a running capture keeps the emulation going
+    const bool sound_playing = (stm_ms(stm_diff(now, state.idle.last_sound_time)) < IDLE_SOUND_TIMEOUT_MS) || capture_isvalid();
+    if (state.idle.hidden) {
+        *out_run_emu = sound_playing;
+        return IDLE_STOP;
+    }
+    if (state.idle.unfocused) {
+        *out_run_emu = sound_playing;
+        return IDLE_THROTTLE;
+    }
+    #if defined(CHIPS_USE_UI)
+    // stopped in the debugger and no user interaction for a while
+    if (state.zx.debug.stopped && *state.zx.debug.stopped &&
+        (stm_ms(stm_diff(now, state.idle.last_input_time)) > IDLE_INPUT_TIMEOUT_MS))
+    {
+        return IDLE_THROTTLE;
+    }
+    #endif
+    return IDLE_NONE;
+}
 
 void app_frame(void) {
+    if (state.bench.num_frames > 0) {
+        run_benchmark();
+        return;
+    }
+    bool run_emu = true;
+    const idle_mode_t idle = idle_mode(&run_emu);
+    if (state.emu_thread.enabled || (state.tiles.num > 1)) {
+        thread_atomic_store(&state.idle.paused, run_emu ? 0 : 1);
+    }
+    // keep the audio buffer fill level steady (not needed when audio drives the emulation)
+    if (!audio_pull_mode()) {
+        const audio_stats_t snd_stats = audio_stats();
+        clock_rate_control(snd_stats.fill, snd_stats.target_fill);
+    }
     state.frame_time_us = clock_frame_time();
-    const uint64_t emu_start_time = stm_now();
-    state.ticks = zx_exec(&state.zx, state.frame_time_us);
-    state.emu_time_ms = stm_ms(stm_since(emu_start_time));
-    draw_status_bar();
-    gfx_draw(zx_display_width(&state.zx), zx_display_height(&state.zx));
+    #if !defined(__EMSCRIPTEN__)
+    if (idle == IDLE_THROTTLE) {
+        // sleep until the next present slot, and emulate the time since the last present
+        const double since_present_ms = stm_ms(stm_since(state.idle.last_present_time));
+        if (since_present_ms < IDLE_PRESENT_INTERVAL_MS) {
+            thread_sleep_us((uint32_t) ((IDLE_PRESENT_INTERVAL_MS - since_present_ms) * 1000.0));
+        }
+        double throttled_ms = stm_ms(stm_since(state.idle.last_present_time));
+        if (throttled_ms > (2.0 * IDLE_PRESENT_INTERVAL_MS)) {
+            throttled_ms = 2.0 * IDLE_PRESENT_INTERVAL_MS;
+        }
+        state.frame_time_us = (uint32_t) (throttled_ms * 1000.0);
+    }
+    #endif
+    if (!state.emu_thread.enabled && run_emu) {
+        // in audio pull mode, the audio device's demand drives the emulation
+        const uint32_t emu_time_us = audio_pull_mode() ? audio_pull_time(state.frame_time_us) : state.frame_time_us;
+        const uint64_t emu_start_time = stm_now();
+        prof_begin("emu_exec");
+        state.ticks = emu_exec(emu_time_us);
+        prof_end();
+        state.emu_time_ms = stm_ms(stm_since(emu_start_time));
+    }
     handle_file_loading();
     send_keybuf_input();
+    if (idle == IDLE_STOP) {
+        #if !defined(__EMSCRIPTEN__)
+        thread_sleep_us(IDLE_SLEEP_US);
+        #endif
+        return;
+    }
+    state.idle.last_present_time = stm_now();
+    draw_status_bar();
+    if (gfx_zx_decode()) {
+        update_zx_screen();
+    }
+    gfx_draw(zx_display_width(&state.zx), zx_display_height(&state.zx));
 }
 
 void app_input(const sapp_event* event) {
+    // track window state and user interaction for idle mode
+    state.idle.last_input_time = stm_now();
+    switch (event->type) {
+        case SAPP_EVENTTYPE_ICONIFIED:
+        case SAPP_EVENTTYPE_SUSPENDED:
+            state.idle.hidden = true;
+            break;
+        case SAPP_EVENTTYPE_RESTORED:
+        case SAPP_EVENTTYPE_RESUMED:
+            state.idle.hidden = false;
+            break;
+        case SAPP_EVENTTYPE_UNFOCUSED:
+            state.idle.unfocused = true;
+            break;
+        case SAPP_EVENTTYPE_FOCUSED:
+            state.idle.unfocused = false;
+            break;
+        default:
+            break;
+    }
     // accept dropped files also when ImGui grabs input
     if (event->type == SAPP_EVENTTYPE_FILES_DROPPED) {
         fs_start_load_dropped_file();
@@ -183,12 +612,42 @@ void app_input(const sapp_event* event) {
         case SAPP_EVENTTYPE_CHAR:
             c = (int) event->char_code;
             if ((c > 0x20) && (c < 0x7F)) {
-                zx_key_down(&state.zx, c);
-                zx_key_up(&state.zx, c);
+                emu_lock();
+                key_down(c);
+                key_up(c);
+                emu_unlock();
             }
             break;
         case SAPP_EVENTTYPE_KEY_DOWN:
         case SAPP_EVENTTYPE_KEY_UP:
+            // hold F1 to rewind
+            if ((event->key_code == SAPP_KEYCODE_F1) && state.rewind.enabled) {
+                thread_atomic_store(&state.rewind.active, (event->type == SAPP_EVENTTYPE_KEY_DOWN) ? 1 : 0);
+                break;
+            }
+            // F3 toggles the profiler zone overlay
+            if (event->key_code == SAPP_KEYCODE_F3) {
+                if ((event->type == SAPP_EVENTTYPE_KEY_DOWN) && !event->key_repeat) {
+                    state.prof_overlay = !state.prof_overlay;
+                }
+                break;
+            }
+            #ifdef CHIPS_USE_UI
+            // F2 toggles the Z80 profiler window
+            if (event->key_code == SAPP_KEYCODE_F2) {
+                if ((event->type == SAPP_EVENTTYPE_KEY_DOWN) && !event->key_repeat) {
+                    state.ui_z80prof.open = !state.ui_z80prof.open;
+                }
+                break;
+            }
+            #endif
+            // F4 writes the recent profiler zone calls to the trace file
+            if ((event->key_code == SAPP_KEYCODE_F4) && state.trace_path) {
+                if ((event->type == SAPP_EVENTTYPE_KEY_DOWN) && !event->key_repeat) {
+                    write_trace();
+                }
+                break;
+            }
             switch (event->key_code) {
                 case SAPP_KEYCODE_SPACE:        c = 0x20; break;
                 case SAPP_KEYCODE_LEFT:         c = 0x08; break;
@@ -202,12 +661,14 @@ void app_input(const sapp_event* event) {
                 default:                        c = 0; break;
             }
             if (c) {
+                emu_lock();
                 if (event->type == SAPP_EVENTTYPE_KEY_DOWN) {
-                    zx_key_down(&state.zx, c);
+                    key_down(c);
                 }
                 else {
-                    zx_key_up(&state.zx, c);
+                    key_up(c);
                 }
+                emu_unlock();
             }
             break;
         default:
@@ -216,26 +677,380 @@ void app_input(const sapp_event* event) {
 }
 
 void app_cleanup(void) {
+    if (state.emu_thread.enabled) {
+        thread_atomic_store(&state.emu_thread.quit, 1);
+        thread_join(state.emu_thread.thread);
+        thread_mutex_destroy(state.emu_thread.lock);
+        state.emu_thread.enabled = false;
+    }
+    discard_tiles();
+    if (state.trace_path) {
+        write_trace();
+    }
+    if (state.z80prof.csv_path) {
+        if (z80prof_write_csv(&state.z80prof.prof, state.z80prof.csv_path)) {
+            printf("Z80 profile written to '%s'\n", state.z80prof.csv_path);
+        }
+        else {
+            fprintf(stderr, "failed to write Z80 profile '%s'\n", state.z80prof.csv_path);
+        }
+    }
+    if (state.z80prof.folded_path) {
+        if (z80prof_write_folded(&state.z80prof.prof, state.z80prof.folded_path)) {
+            printf("Z80 call stacks written to '%s'\n", state.z80prof.folded_path);
+        }
+        else {
+            fprintf(stderr, "failed to write Z80 call stacks '%s'\n", state.z80prof.folded_path);
+        }
+    }
+    if (state.movie.record_path) {
+        save_movie(state.movie.record_path);
+    }
+    if (capture_isvalid()) {
+        const capture_stats_t stats = capture_stats();
+        capture_shutdown();
+        printf("captured %llu frames (%llu dropped)\n", (unsigned long long)stats.frames, (unsigned long long)stats.dropped_frames);
+    }
+    zx_movie_discard(&state.movie.movie);
     zx_discard(&state.zx);
+    if (state.rewind.enabled) {
+        rewind_shutdown();
+        state.rewind.enabled = false;
+    }
     #ifdef CHIPS_USE_UI
+        ui_z80prof_discard(&state.ui_z80prof);
         ui_zx_discard(&state.ui_zx);
         ui_discard();
     #endif
-    saudio_shutdown();
+    z80prof_discard(&state.z80prof.prof);
+    audio_shutdown();
     gfx_shutdown();
     sargs_shutdown();
 }
 
 static void send_keybuf_input(void) {
-    uint8_t key_code;
-    if (0 != (key_code = keybuf_get(state.frame_time_us))) {
-        zx_key_down(&state.zx, key_code);
-        zx_key_up(&state.zx, key_code);
+    prof_begin("keybuf_get");
+    const uint8_t key_code = keybuf_get(state.frame_time_us);
+    prof_end();
+    if (0 != key_code) {
+        emu_lock();
+        key_down(key_code);
+        key_up(key_code);
+        emu_unlock();
     }
 }
 
+// hand a finished video frame to the render thread
+static void publish_zx_frame(zx_t* sys) {
+    if (state.emu_thread.enabled) {
+        gfx_framebuffer_publish(zx_display_width(sys), zx_display_height(sys));
+    }
+}
+
+static void runahead_zx_frame(zx_t* sys, void* user_data) {
+    (void)user_data;
+    publish_zx_frame(sys);
+}
+
+/* run the emulator a few frames ahead with the current input and without
+   audio, so that the key press which a game polls once per frame becomes
+   visible immediately, then restore the emulator state (the framebuffer
+   keeps the run-ahead frame for presentation, the emulator thread publishes
+   only the completed run-ahead frames)
+*/
+static void run_ahead(void) {
+    if (state.runahead.num_frames <= 0) {
+        return;
+    }
+    const uint64_t start_time = stm_now();
+    prof_begin("run_ahead");
+    memcpy(&state.runahead.snapshot, &state.zx, sizeof(zx_t));
+    state.runahead.active = true;
+    state.z80prof.prof.suspended = true;
+    const uint32_t runahead_us = (uint32_t)state.runahead.num_frames * ZX_FRAME_TIME_US;
+    if (state.emu_thread.enabled) {
+        zx_exec_frames(&state.zx, runahead_us, runahead_zx_frame, 0);
+    }
+    else {
+        zx_exec(&state.zx, runahead_us);
+    }
+    state.runahead.active = false;
+    state.z80prof.prof.suspended = false;
+    // the framebuffer keeps the run-ahead frame, the GPU decoder needs the matching video memory
+    if (gfx_zx_decode()) {
+        grab_zx_screen(&state.runahead.screen);
+    }
+    memcpy(&state.zx, &state.runahead.snapshot, sizeof(zx_t));
+    prof_end();
+    state.runahead.time_ms = stm_ms(stm_since(start_time));
+}
+
+// hand a finished video frame to the capture writer, and to the render thread unless run-ahead replaces it
+static void exec_zx_frame(zx_t* sys, void* user_data) {
+    (void)user_data;
+    if (capture_isvalid()) {
+        capture_frame(gfx_framebuffer(), zx_display_width(sys), zx_display_height(sys));
+    }
+    if (state.runahead.num_frames <= 0) {
+        publish_zx_frame(sys);
+    }
+}
+
+/* run the emulator, while capturing or running on the emulator thread split
+   the time slice at the end of each emulated video frame, so that captured
+   and published frames don't contain parts of two frames, and the captured
+   frames stay aligned with the audio
+*/
+static uint32_t exec_and_capture(uint32_t micro_seconds) {
+    if (!capture_isvalid() && !state.emu_thread.enabled) {
+        return zx_exec(&state.zx, micro_seconds);
+    }
+    return zx_exec_frames(&state.zx, micro_seconds, exec_zx_frame, 0);
+}
+
+// a replayed rewind frame is only presented, never captured
+static void replay_zx_frame(zx_t* sys, void* user_data) {
+    (void)user_data;
+    publish_zx_frame(sys);
+}
+
+/* restore the previous rewind state, the rewind buffer holds whole zx_t
+   copies, so keep the current host-side connections (same as in
+   zx_load_state()), otherwise e.g. the debug hooks would be restored as
+   they were when the state was captured
+*/
+static bool rewind_pop_state(void) {
+    uint32_t* pixel_buffer = state.zx.pixel_buffer;
+    const chips_audio_callback_t audio_callback = state.zx.audio.callback;
+    const chips_debug_t debug = state.zx.debug;
+    if (!rewind_pop(&state.zx)) {
+        return false;
+    }
+    state.zx.pixel_buffer = pixel_buffer;
+    state.zx.audio.callback = audio_callback;
+    state.zx.debug = debug;
+    return true;
+}
+
+/* run the emulator in fixed movie slices while a movie is recorded or played back,
+   otherwise run the emulator forward, capturing one rewind state per emulated frame,
+   or while F1 is held, step backward one captured frame per emulated frame
+   and run that frame without audio to get its video output
+*/
+static uint32_t emu_exec(uint32_t micro_seconds) {
+    if (zx_movie_active(&state.movie.movie)) {
+        // fixed-size slices keep the recording and playback deterministic
+        uint32_t ticks = 0;
+        state.movie.time_us += micro_seconds;
+        while (zx_movie_active(&state.movie.movie) && (state.movie.time_us >= ZX_MOVIE_FRAME_TIME_US)) {
+            state.movie.time_us -= ZX_MOVIE_FRAME_TIME_US;
+            const uint32_t slice_ticks = zx_movie_exec_frame(&state.movie.movie, &state.zx);
+            ticks += slice_ticks;
+            if (capture_isvalid()) {
+                // the movie slices can't be split at the frame end, so capture
+                // as many frames as fit into the emulated time, at the slice end
+                state.capture.ticks += slice_ticks;
+                while (state.capture.ticks >= zx_frame_ticks(state.zx.type)) {
+                    state.capture.ticks -= zx_frame_ticks(state.zx.type);
+                    capture_frame(gfx_framebuffer(), zx_display_width(&state.zx), zx_display_height(&state.zx));
+                }
+            }
+        }
+        // for the same reason the emulator thread publishes at the end of the slices
+        if ((ticks > 0) && (state.runahead.num_frames <= 0)) {
+            publish_zx_frame(&state.zx);
+        }
+        run_ahead();
+        return ticks;
+    }
+    if (!state.rewind.enabled) {
+        const uint32_t ticks = exec_and_capture(micro_seconds);
+        run_ahead();
+        return ticks;
+    }
+    state.rewind.time_us += micro_seconds;
+    if (thread_atomic_load(&state.rewind.active)) {
+        if (state.rewind.time_us < ZX_FRAME_TIME_US) {
+            return 0;
+        }
+        // keep the remainder, so that on average one frame is popped per emulated
+        // frame time (at most one per call, longer time slices drop the surplus)
+        state.rewind.time_us %= ZX_FRAME_TIME_US;
+        if (!rewind_pop_state()) {
+            // rewind history exhausted, keep showing the oldest frame
+            return 0;
+        }
+        // replayed frames aren't profiled again
+        state.z80prof.prof.suspended = true;
+        const uint32_t ticks = zx_exec_frames(&state.zx, ZX_FRAME_TIME_US, replay_zx_frame, 0);
+        state.z80prof.prof.suspended = false;
+        z80prof_resync(&state.z80prof.prof);
+        return ticks;
+    }
+    const uint32_t ticks = exec_and_capture(micro_seconds);
+    if (state.rewind.time_us >= ZX_FRAME_TIME_US) {
+        state.rewind.time_us %= ZX_FRAME_TIME_US;
+        prof_begin("rewind_capture");
+        rewind_capture(&state.zx);
+        prof_end();
+    }
+    run_ahead();
+    return ticks;
+}
+
+/* the emulator thread runs the emulator in short real-time slices and hands
+   each finished video frame to gfx_draw() through the triple-buffer (from
+   within emu_exec()), so that emulation and presentation overlap instead of
+   adding up
+*/
+static void emu_thread_func(void* arg) {
+    (void)arg;
+    prof_trace_thread_name("emu");
+    uint64_t last_time = stm_now();
+    while (0 == thread_atomic_load(&state.emu_thread.quit)) {
+        uint32_t slice_time_us = (uint32_t) stm_us(stm_laptime(&last_time));
+        // same death-spiral protection as in clock_frame_time()
+        if (slice_time_us > 24000) {
+            slice_time_us = 24000;
+        }
+        // the rate correction is updated on the main thread and published atomically
+        slice_time_us = (uint32_t) ((double)slice_time_us * clock_rate_correction());
+        if (audio_pull_mode()) {
+            slice_time_us = audio_pull_time(slice_time_us);
+        }
+        if (thread_atomic_load(&state.idle.paused)) {
+            thread_sleep_us(EMU_THREAD_SLICE_US);
+            continue;
+        }
+        thread_mutex_lock(state.emu_thread.lock);
+        const uint64_t emu_start_time = stm_now();
+        prof_begin("emu_exec");
+        state.ticks = emu_exec(slice_time_us);
+        prof_end();
+        state.emu_time_ms = stm_ms(stm_since(emu_start_time));
+        thread_mutex_unlock(state.emu_thread.lock);
+        const uint32_t busy_time_us = (uint32_t) stm_us(stm_since(last_time));
+        if (busy_time_us < EMU_THREAD_SLICE_US) {
+            thread_sleep_us(EMU_THREAD_SLICE_US - busy_time_us);
+        }
+    }
+}
+
+// the additional tiles have no audio output
+static void tile_push_audio(const float* samples, int num_samples, void* user_data) {
+    (void)samples;
+    (void)num_samples;
+    (void)user_data;
+}
+
+// hand a finished video frame of a tile to the render thread
+static void tile_zx_frame(zx_t* sys, void* user_data) {
+    const tile_t* tile = (const tile_t*) user_data;
+    gfx_tile_publish(tile->index, zx_display_width(sys), zx_display_height(sys));
+}
+
+/* the additional tiles run in real time on their own threads, without
+   audio and keyboard input, and hand their frames to gfx_draw() through
+   their triple-buffers, where all tiles are uploaded in one texture atlas
+*/
+static void tile_thread_func(void* arg) {
+    tile_t* tile = (tile_t*) arg;
+    uint64_t last_time = stm_now();
+    uint32_t boot_time_us = 0;
+    while (0 == thread_atomic_load(&state.tiles.quit)) {
+        uint32_t slice_time_us = (uint32_t) stm_us(stm_laptime(&last_time));
+        if (slice_time_us > 24000) {
+            slice_time_us = 24000;
+        }
+        if (0 == thread_atomic_load(&state.idle.paused)) {
+            zx_exec_frames(&tile->zx, slice_time_us, tile_zx_frame, tile);
+            if (tile->file_data) {
+                boot_time_us += slice_time_us;
+                if (boot_time_us >= TILE_LOAD_DELAY_US) {
+                    if (!zx_quickload(&tile->zx, tile->file_data, tile->file_size)) {
+                        fprintf(stderr, "failed to load snapshot into tile %d\n", tile->index);
+                    }
+                    free(tile->file_data);
+                    tile->file_data = 0;
+                }
+            }
+        }
+        const uint32_t busy_time_us = (uint32_t) stm_us(stm_since(last_time));
+        if (busy_time_us < EMU_THREAD_SLICE_US) {
+            thread_sleep_us(EMU_THREAD_SLICE_US - busy_time_us);
+        }
+    }
+}
+
+static void load_tile_file(tile_t* tile, const char* path) {
+    FILE* fp = fopen(path, "rb");
+    if (!fp) {
+        fprintf(stderr, "failed to open '%s' for tile %d\n", path, tile->index);
+        return;
+    }
+    fseek(fp, 0, SEEK_END);
+    const long size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    if (size > 0) {
+        tile->file_data = (uint8_t*) malloc((size_t)size);
+        assert(tile->file_data);
+        tile->file_size = (int)fread(tile->file_data, 1, (size_t)size, fp);
+    }
+    fclose(fp);
+}
+
+/* boot the additional emulator tiles (tiles=N) with the same machine
+   config as the main instance, tileN=path loads a snapshot into tile N
+*/
+static void init_tiles(zx_type_t type, zx_joystick_type_t joy_type) {
+    for (int i = 1; i < state.tiles.num; i++) {
+        tile_t* tile = (tile_t*) calloc(1, sizeof(tile_t));
+        assert(tile);
+        tile->index = i;
+        char key[16];
+        snprintf(key, sizeof(key), "tile%d", i);
+        if (sargs_exists(key)) {
+            load_tile_file(tile, sargs_value(key));
+        }
+        zx_desc_t desc = zx_desc(type, joy_type);
+        desc.pixel_buffer.ptr = gfx_tile_framebuffer(i);
+        desc.pixel_buffer.size = gfx_framebuffer_size();
+        desc.audio.callback.func = tile_push_audio;
+        desc.audio.callback.user_data = 0;
+        memset(&desc.debug, 0, sizeof(desc.debug));
+        zx_init(&tile->zx, &desc);
+        state.tiles.items[i] = tile;
+        tile->thread = thread_start(tile_thread_func, tile);
+        if (!tile->thread.handle) {
+            fprintf(stderr, "failed to start thread for tile %d\n", i);
+        }
+    }
+}
+
+static void discard_tiles(void) {
+    thread_atomic_store(&state.tiles.quit, 1);
+    for (int i = 1; i < state.tiles.num; i++) {
+        tile_t* tile = state.tiles.items[i];
+        thread_join(tile->thread);
+        zx_discard(&tile->zx);
+        free(tile->file_data);
+        free(tile);
+        state.tiles.items[i] = 0;
+    }
+}
+
+/* a loaded snapshot, state or movie replaces the CPU state and maybe the
+   model, so the profiler continues at the new PC with the new frame length
+*/
+static void resync_z80prof(void) {
+    state.z80prof.prof.frame_ticks = zx_frame_ticks(state.zx.type);
+    z80prof_resync(&state.z80prof.prof);
+}
+
 static void handle_file_loading(void) {
+    prof_begin("fs_dowork");
     fs_dowork();
+    prof_end();
     const uint32_t load_delay_frames = 120;
     if (fs_ptr() && clock_frame_count_60hz() > load_delay_frames) {
         bool load_success = false;
@@ -243,8 +1058,34 @@ static void handle_file_loading(void) {
             load_success = true;
             keybuf_put((const char*)fs_ptr());
         }
+        else if (fs_ext("zxm")) {
+            emu_lock();
+            load_success = zx_movie_play(&state.movie.movie, &state.zx, fs_ptr(), fs_size());
+            if (load_success) {
+                resync_z80prof();
+            }
+            emu_unlock();
+        }
+        else if (fs_ext("zxs")) {
+            emu_lock();
+            load_success = zx_load_state(&state.zx, fs_ptr(), fs_size());
+            if (load_success) {
+                resync_z80prof();
+            }
+            emu_unlock();
+        }
         else {
+            emu_lock();
             load_success = zx_quickload(&state.zx, fs_ptr(), fs_size());
+            if (load_success) {
+                resync_z80prof();
+            }
+            emu_unlock();
+        }
+        if (load_success && state.movie.record_path && !zx_movie_active(&state.movie.movie)) {
+            emu_lock();
+            zx_movie_record(&state.movie.movie, &state.zx);
+            emu_unlock();
         }
         if (load_success) {
             if (clock_frame_count_60hz() > (load_delay_frames + 10)) {
@@ -261,26 +1102,281 @@ static void handle_file_loading(void) {
     }
 }
 
+/* copy the raw video memory and flash phase, and the border color of each
+   display line (taken from the first pixel of the decoded line), all from
+   the same emulated frame
+*/
+static void grab_zx_screen(zx_screen_t* screen) {
+    const int width = zx_display_width(&state.zx);
+    int num_lines = zx_display_height(&state.zx);
+    if (num_lines > GFX_ZX_MAX_LINES) {
+        num_lines = GFX_ZX_MAX_LINES;
+    }
+    const uint32_t* fb = gfx_framebuffer();
+    uint8_t idx = 0;
+    for (int y = 0; y < num_lines; y++) {
+        const uint32_t c = fb[y * width];
+        if (c != zx_palette[idx]) {
+            for (idx = 0; (idx < 7) && (c != zx_palette[idx]); idx++);
+        }
+        screen->border_lines[y] = idx;
+    }
+    screen->num_lines = num_lines;
+    memcpy(screen->vram, state.zx.ram[state.zx.display_ram_bank], GFX_ZX_VRAM_SIZE);
+    screen->flash = 0 != (state.zx.blink_counter & 0x10);
+}
+
+/* hand the raw video memory to the GPU screen decoder, with run-ahead the
+   screen of the run-ahead frame which was grabbed before the emulator
+   state was restored
+*/
+static void update_zx_screen(void) {
+    static zx_screen_t screen;
+    emu_lock();
+    if (state.runahead.num_frames > 0) {
+        screen = state.runahead.screen;
+    }
+    else {
+        grab_zx_screen(&screen);
+    }
+    emu_unlock();
+    if (screen.num_lines > 0) {
+        gfx_zx_screen(screen.vram, screen.border_lines, screen.num_lines, screen.flash, ZX_SCREEN_X, ZX_SCREEN_Y);
+    }
+}
+
+static void save_movie(const char* path) {
+    emu_lock();
+    zx_movie_stop(&state.movie.movie);
+    emu_unlock();
+    const size_t size = zx_movie_data_size(&state.movie.movie);
+    void* buf = malloc(size);
+    assert(buf);
+    bool success = zx_movie_save(&state.movie.movie, buf, size);
+    FILE* fp = fopen(path, "wb");
+    if (fp) {
+        success &= (size == fwrite(buf, 1, size, fp));
+        fclose(fp);
+    }
+    else {
+        success = false;
+    }
+    free(buf);
+    if (success) {
+        printf("movie with %d key events written to '%s'\n", state.movie.movie.num_events, path);
+    }
+    else {
+        fprintf(stderr, "failed to write movie '%s'\n", path);
+    }
+}
+
+static void write_trace(void) {
+    if (prof_trace_write(state.trace_path)) {
+        printf("profiler trace written to '%s'\n", state.trace_path);
+    }
+    else {
+        fprintf(stderr, "failed to write profiler trace '%s'\n", state.trace_path);
+    }
+}
+
+static int cmp_float(const void* a, const void* b) {
+    const float fa = *(const float*)a;
+    const float fb = *(const float*)b;
+    return (fa < fb) ? -1 : ((fa > fb) ? 1 : 0);
+}
+
+/* run the benchmark frames back-to-back with a fixed time slice and without
+   rendering, then print a throughput report as JSON and quit
+*/
+static void run_benchmark(void) {
+    // wait until a file passed on the command line has been fetched, so that
+    // the file I/O doesn't end up in the measurement
+    if (sargs_exists("file") && !fs_ptr()) {
+        if (fs_failed()) {
+            fprintf(stderr, "bench: failed to load '%s'\n", sargs_value("file"));
+            exit(EXIT_FAILURE);
+        }
+        fs_dowork();
+        return;
+    }
+    const int num_frames = state.bench.num_frames;
+    state.bench.num_frames = 0;
+    // boot the system and load the file untimed, so that only the loaded program is measured
+    while (fs_ptr()) {
+        state.frame_time_us = clock_frame_time();
+        zx_exec(&state.zx, state.frame_time_us);
+        handle_file_loading();
+        send_keybuf_input();
+    }
+    float* emu_times = malloc((size_t)num_frames * sizeof(float));
+    assert(emu_times);
+    uint64_t num_ticks = 0;
+    double total_time_ms = 0.0;
+    for (int i = 0; i < num_frames; i++) {
+        state.frame_time_us = clock_frame_time();
+        const uint64_t emu_start_time = stm_now();
+        state.ticks = zx_exec(&state.zx, state.frame_time_us);
+        state.emu_time_ms = stm_ms(stm_since(emu_start_time));
+        emu_times[i] = (float)state.emu_time_ms;
+        total_time_ms += state.emu_time_ms;
+        num_ticks += state.ticks;
+        handle_file_loading();
+        send_keybuf_input();
+    }
+    qsort(emu_times, (size_t)num_frames, sizeof(float), cmp_float);
+    int p99_index = (int)(0.99 * (double)num_frames);
+    if (p99_index >= num_frames) {
+        p99_index = num_frames - 1;
+    }
+    const double total_time_s = total_time_ms * 0.001;
+    printf("{\"frames\":%d,\"frame_time_us\":%d,\"ticks\":%llu,\"emu_mhz\":%.3f,\"frames_per_sec\":%.1f,"
+           "\"emu_time_ms\":{\"min\":%.4f,\"avg\":%.4f,\"max\":%.4f,\"p99\":%.4f}}\n",
+        num_frames,
+        BENCH_FRAME_TIME_US,
+        (unsigned long long)num_ticks,
+        (total_time_s > 0.0) ? ((double)num_ticks / total_time_s) / 1000000.0 : 0.0,
+        (total_time_s > 0.0) ? (double)num_frames / total_time_s : 0.0,
+        emu_times[0],
+        total_time_ms / (double)num_frames,
+        emu_times[num_frames - 1],
+        emu_times[p99_index]);
+    fflush(stdout);
+    free(emu_times);
+    sapp_request_quit();
+}
+
+/* list the profiler zones as a tree at the top of the window, with the
+   call count, the average inclusive and self time per call and the
+   inclusive p99 time of the last reporting window
+*/
+static void draw_prof_zones(void) {
+    sdtx_pos(1.0f, (float)(BORDER_TOP / 8) + 1.0f);
+    sdtx_color3b(255, 255, 0);
+    sdtx_printf("%-24s %8s %9s %9s %9s\n", "zone (F3)", "calls", "incl", "self", "p99");
+    const int num_zones = state.prof_window.num_zones;
+    for (int i = 0; i < num_zones; i++) {
+        const prof_zone_stats_t zone = state.prof_window.zones[i];
+        const int indent = (zone.depth < 8) ? zone.depth * 2 : 16;
+        sdtx_printf(" %*s%-*s %8llu %7.3fms %7.3fms %7.3fms\n",
+            indent, "",
+            23 - indent, zone.name,
+            (unsigned long long)zone.calls,
+            zone.incl.avg_val,
+            zone.self.avg_val,
+            zone.incl.p99_val);
+    }
+}
+
+/* once per reporting window, keep the profiler statistics for display
+   and start a new window, so that the displayed values don't jitter
+   and old spikes don't stick around
+*/
+static void update_prof_window(void) {
+    if (0 == state.prof_window.start) {
+        state.prof_window.start = stm_now();
+        return;
+    }
+    if (stm_ms(stm_since(state.prof_window.start)) < PROF_WINDOW_MS) {
+        return;
+    }
+    state.prof_window.start = stm_now();
+    state.prof_window.emu = prof_stats(PROF_EMU);
+    state.prof_window.upload = prof_stats(PROF_UPLOAD);
+    prof_reset(PROF_EMU);
+    prof_reset(PROF_UPLOAD);
+    // the emulator thread updates its zones while it holds the emulator lock
+    emu_lock();
+    state.prof_window.num_zones = prof_num_zones();
+    for (int i = 0; i < state.prof_window.num_zones; i++) {
+        state.prof_window.zones[i] = prof_zone_stats(i);
+    }
+    prof_reset_zones();
+    emu_unlock();
+}
+
 static void draw_status_bar(void) {
+    emu_lock();
     prof_push(PROF_EMU, (float)state.emu_time_ms);
-    prof_stats_t emu_stats = prof_stats(PROF_EMU);
+    const uint32_t ticks = state.ticks;
+    const double runahead_time_ms = state.runahead.time_ms;
+    const bool movie_recording = state.movie.movie.recording;
+    const bool movie_playing = state.movie.movie.playing;
+    const bool movie_desync = state.movie.movie.desync;
+    const int movie_events = movie_playing ? state.movie.movie.cur_event : state.movie.movie.num_events;
+    const rewind_stats_t rwnd_stats = state.rewind.enabled ? rewind_stats() : (rewind_stats_t){0};
+    emu_unlock();
+    update_prof_window();
+    const prof_stats_t emu_stats = state.prof_window.emu;
+    const prof_stats_t upload_stats = state.prof_window.upload;
+    const audio_stats_t snd_stats = audio_stats();
     const float w = sapp_widthf();
     const float h = sapp_heightf();
     sdtx_canvas(w, h);
     sdtx_color3b(255, 255, 255);
-    sdtx_pos(1.0f, (h / 8.0f) - 1.5f);
-    sdtx_printf("frame:%.2fms emu:%.2fms (min:%.2fms max:%.2fms) ticks:%d", (float)state.frame_time_us * 0.001f, emu_stats.avg_val, emu_stats.min_val, emu_stats.max_val, state.ticks);
+    sdtx_pos(1.0f, (h / 8.0f) - 3.5f);
+    sdtx_printf("frame:%.2fms emu:%.2fms (p99:%.2fms max:%.2fms) ticks:%d upload:%.3fms (p99:%.3fms)", (float)state.frame_time_us * 0.001f, emu_stats.avg_val, emu_stats.p99_val, emu_stats.max_val, ticks, upload_stats.avg_val, upload_stats.p99_val);
+    sdtx_pos(1.0f, (h / 8.0f) - 2.5f);
+    sdtx_printf("audio:%d%%%s xruns:%u/%u rate:%+.2f%%",
+        (100 * snd_stats.fill) / snd_stats.capacity,
+        audio_pull_mode() ? " (pull)" : "",
+        snd_stats.underruns,
+        snd_stats.overruns,
+        (clock_rate_correction() - 1.0) * 100.0);
+    if (state.runahead.num_frames > 0) {
+        sdtx_printf(" runahead:%d (+%.2fms)", state.runahead.num_frames, runahead_time_ms);
+    }
+    if (state.tiles.num > 1) {
+        sdtx_printf(" tiles:%d", state.tiles.num);
+    }
+    if (movie_recording || movie_playing) {
+        sdtx_printf(" movie:%s(%d)%s", movie_recording ? "rec" : "play", movie_events, movie_desync ? " DESYNC" : "");
+    }
+    if (capture_isvalid()) {
+        const capture_stats_t cap_stats = capture_stats();
+        sdtx_printf(" capture:%llu (dropped:%llu)", (unsigned long long)cap_stats.frames, (unsigned long long)cap_stats.dropped_frames);
+    }
+    if (state.rewind.enabled) {
+        sdtx_pos(1.0f, (h / 8.0f) - 1.5f);
+        sdtx_printf("rewind(F1):%.1fs%s mem:%.1f/%.1fMB capture:%.3fms",
+            (float)(rwnd_stats.num_frames * ZX_FRAME_TIME_US) * 0.000001f,
+            thread_atomic_load(&state.rewind.active) ? " <<" : "",
+            (double)rwnd_stats.arena_used / (1024.0 * 1024.0),
+            (double)rwnd_stats.arena_size / (1024.0 * 1024.0),
+            rwnd_stats.capture_time_ms);
+    }
+    if (state.prof_overlay) {
+        draw_prof_zones();
+    }
 }
 
 sapp_desc sokol_main(int argc, char* argv[]) {
     sargs_setup(&(sargs_desc){ .argc=argc, .argv=argv });
+    // 2x display, or with several tiles (same grid layout and 1-texel gutter
+    // as in gfx.h) each tile at 1x, tiles aren't supported on the web
+    int width = 2 * zx_std_display_width();
+    int height = 2 * zx_std_display_height();
+    #if !defined(__EMSCRIPTEN__)
+    int num_tiles = sargs_exists("tiles") ? atoi(sargs_value("tiles")) : 1;
+    if (num_tiles > GFX_MAX_TILES) {
+        num_tiles = GFX_MAX_TILES;
+    }
+    if (num_tiles > 1) {
+        int cols = 1;
+        while ((cols * cols) < num_tiles) {
+            cols++;
+        }
+        const int rows = (num_tiles + cols - 1) / cols;
+        width = cols * (zx_std_display_width() + 1) - 1;
+        height = rows * (zx_std_display_height() + 1) - 1;
+    }
+    #endif
     return (sapp_desc) {
         .init_cb = app_init,
         .frame_cb = app_frame,
         .event_cb = app_input,
         .cleanup_cb = app_cleanup,
-        .width = 2 * zx_std_display_width() + BORDER_LEFT + BORDER_RIGHT,
-        .height = 2 * zx_std_display_height() + BORDER_TOP + BORDER_BOTTOM,
+        .width = width + BORDER_LEFT + BORDER_RIGHT,
+        .height = height + BORDER_TOP + BORDER_BOTTOM,
         .window_title = "ZX Spectrum",
         .icon.sokol_default = true,
         .enable_dragndrop = true,
@@ -0,0 +1,101 @@
+//------------------------------------------------------------------------------
+//  rewind-test.c
+//  Test the rewind buffer in examples/common/rewind.h.
+//------------------------------------------------------------------------------
+#define SOKOL_IMPL
+#include "sokol_time.h"
+#define COMMON_IMPL
+#include "rewind.h"
+#include "utest.h"
+#include <string.h>
+
+#define T(b) ASSERT_TRUE(b)
+
+#define STATE_SIZE (256)
+#define MAX_FRAMES (64)
+#define NUM_STEPS (120)
+
+// the captured states, newest last
+static uint8_t history[NUM_STEPS][STATE_SIZE];
+static int num_history;
+
+static uint32_t rnd(uint32_t* r) {
+    *r = *r * 1103515245 + 12345;
+    return *r >> 16;
+}
+
+UTEST(rewind, capture_pop) {
+    stm_setup();
+    rewind_init(&(rewind_desc_t){
+        .state_size = STATE_SIZE,
+        .arena_size = 64 * 1024,
+        .max_frames = MAX_FRAMES,
+        .keyframe_interval = 8,
+    });
+    for (int i = 0; i < 20; i++) {
+        memset(history[i], i, STATE_SIZE);
+        history[i][i] = 0xFF;
+        rewind_capture(history[i]);
+    }
+    T(rewind_stats().num_frames == 20);
+    T(rewind_stats().num_keyframes == 3);
+    uint8_t state[STATE_SIZE];
+    for (int i = 19; i >= 0; i--) {
+        T(rewind_pop(state));
+        T(0 == memcmp(state, history[i], STATE_SIZE));
+    }
+    T(!rewind_pop(state));
+    rewind_shutdown();
+}
+
+// capture and pop a random mix of small deltas and deltas that are bigger
+// than a keyframe into small arenas, which wrap around many times
+UTEST(rewind, wrap_around) {
+    stm_setup();
+    uint32_t r = 1;
+    for (int run = 0; run < 2000; run++) {
+        const size_t arena_size = 520 + rnd(&r) % 1200;
+        rewind_init(&(rewind_desc_t){
+            .state_size = STATE_SIZE,
+            .arena_size = arena_size,
+            .max_frames = MAX_FRAMES,
+            .keyframe_interval = 2 + (int)(rnd(&r) % 12),
+        });
+        uint8_t state[STATE_SIZE] = { 0 };
+        num_history = 0;
+        for (int i = 0; i < NUM_STEPS; i++) {
+            const uint32_t k = rnd(&r) % 10;
+            if (k < 8) {
+                if (k < 4) {
+                    // change every byte, this delta is bigger than a keyframe
+                    for (int j = 0; j < STATE_SIZE; j++) {
+                        state[j]++;
+                    }
+                }
+                else {
+                    state[rnd(&r) % STATE_SIZE]++;
+                }
+                rewind_capture(state);
+                memcpy(history[num_history++], state, STATE_SIZE);
+            }
+            else if (num_history > 0) {
+                // the rewind buffer may have dropped old frames, but never the newest
+                if (rewind_stats().num_frames > 0) {
+                    T(rewind_pop(state));
+                    T(0 == memcmp(state, history[--num_history], STATE_SIZE));
+                }
+            }
+            T(rewind_stats().arena_used <= arena_size);
+            T(rewind_stats().num_frames <= MAX_FRAMES);
+        }
+        // all remaining frames must be the newest captured states
+        const int num_frames = rewind_stats().num_frames;
+        T(num_frames <= num_history);
+        for (int i = 0; i < num_frames; i++) {
+            T(rewind_pop(state));
+            T(0 == memcmp(state, history[num_history - 1 - i], STATE_SIZE));
+        }
+        T(!rewind_pop(state));
+        rewind_shutdown();
+    }
+}